@@ -1,32 +1,314 @@
 var easymidi = require('easymidi');
-const request = require('request');
+const http = require('http');
+const fs = require('fs');
+const path = require('path');
+const WebSocket = require('ws');
+
+// Note/CC to command map, see mapping.json. Channels are easymidi's 0-15.
+// Any mapping can name a "rig", otherwise the top level "rig" (or the server's default) is used.
+const MAPPING_FILE = process.env.CAMERA_MIDI_MAPPING || path.join(__dirname, 'mapping.json');
+
+// Open the input as a virtual port so a sender on the same machine can drive
+// the bridge without loopMIDI, used to measure note to serial latency
+const VIRTUAL_INPUT = process.env.CAMERA_MIDI_VIRTUAL === '1';
+
+// One warm keep-alive connection to the command server, no handshake per note
+const agent = new http.Agent({ keepAlive: true, keepAliveMsecs: 1000, maxSockets: 4 });
+
+const latency = { count: 0, total: 0, min: Infinity, max: 0 };
+
+// Continuous axes (faders, encoders, pitch bend) are streamed over the command
+// server's /ws joystick socket, coalesced to the newest value per axis
+const AXIS_FLUSH_MS = 10; // 100 Hz at most
+const JOG_MAX = 1000;
+const WS_VELOCITY = 0x01;
+const WS_TARGET = 0x03;
+const AXIS_BITS = { pitch: 1, yaw: 2, zoom: 4 };
+
+function load_mapping() {
+    const mapping = JSON.parse(fs.readFileSync(MAPPING_FILE, 'utf8'));
+    mapping.notes = mapping.notes || [];
+    mapping.cc = mapping.cc || [];
+    mapping.axes = mapping.axes || [];
+    return mapping;
+}
+
+// Holds the newest value of every mapped axis and sends what changed at most
+// every AXIS_FLUSH_MS, so a busy fader never queues up stale positions.
+function AxisStream(base_url, rig) {
+    this.ws_url = base_url.replace(/^http/, 'ws') + 'ws' + (rig ? '?rig=' + encodeURIComponent(rig) : '');
+    this.ws = null;
+    this.vel = { pitch: 0, yaw: 0, zoom: 0 };
+    this.vel_dirty = false;
+    this.target = {};
+    this.timer = null;
+    this.connect();
+}
+
+AxisStream.prototype.connect = function () {
+    var self = this;
+    self.ws = new WebSocket(self.ws_url);
+    self.ws.on('open', () => {
+        console.log('Axis stream connected to %s', self.ws_url);
+        // the server stopped the head when the last socket dropped, a fader still off centre jogs again
+        if (self.vel.pitch !== 0 || self.vel.yaw !== 0 || self.vel.zoom !== 0) {
+            self.vel_dirty = true;
+        }
+        self.flush();
+    });
+    self.ws.on('error', () => {});
+    self.ws.on('close', () => {
+        self.ws = null;
+        setTimeout(() => self.connect(), 1000);
+    });
+};
+
+AxisStream.prototype.set_velocity = function (axis, v) {
+    v = Math.round(Math.max(-1, Math.min(1, v)) * JOG_MAX);
+    if (this.vel[axis] !== v) {
+        this.vel[axis] = v;
+        this.vel_dirty = true;
+        this.schedule();
+    }
+};
+
+AxisStream.prototype.set_target = function (axis, pos) {
+    this.target[axis] = Math.round(pos);
+    this.schedule();
+};
+
+AxisStream.prototype.schedule = function () {
+    var self = this;
+    if (self.timer === null) {
+        self.timer = setTimeout(() => {
+            self.timer = null;
+            self.flush();
+        }, AXIS_FLUSH_MS);
+    }
+};
+
+AxisStream.prototype.flush = function () {
+    // while the socket is down the latest velocity and targets are kept, the open handler sends them
+    if (this.ws === null || this.ws.readyState !== WebSocket.OPEN) {
+        return;
+    }
+    if (this.vel_dirty) {
+        var frame = Buffer.alloc(7);
+        frame.writeUInt8(WS_VELOCITY, 0);
+        frame.writeInt16LE(this.vel.pitch, 1);
+        frame.writeInt16LE(this.vel.yaw, 3);
+        frame.writeInt16LE(this.vel.zoom, 5);
+        this.ws.send(frame);
+        this.vel_dirty = false;
+    }
+    var axes = Object.keys(this.target);
+    if (axes.length > 0) {
+        var target_frame = Buffer.alloc(14);
+        var mask = 0;
+        target_frame.writeUInt8(WS_TARGET, 0);
+        axes.forEach((axis) => {
+            mask |= AXIS_BITS[axis];
+            target_frame.writeInt32LE(this.target[axis], { pitch: 2, yaw: 6, zoom: 10 }[axis]);
+        });
+        target_frame.writeUInt8(mask, 1);
+        this.ws.send(target_frame);
+        this.target = {};
+    }
+};
+
+// Apply a normalised 0..1 control value to its axis mapping
+function apply_axis(stream, m, n) {
+    if (m.invert) {
+        n = 1 - n;
+    }
+    if (m.mode === 'position') {
+        stream.set_target(m.axis, m.min + n * (m.max - m.min));
+        return;
+    }
+    // velocity, centred faders and pitch bend stop in the middle
+    var v = m.center === false ? n : n * 2 - 1;
+    var deadzone = m.deadzone !== undefined ? m.deadzone : 0.03;
+    if (Math.abs(v) < deadzone) {
+        v = 0;
+    }
+    stream.set_velocity(m.axis, v * (m.scale || 1));
+}
+
+function send_cmd(base_url, rig, cmd, wait, cb) {
+    var u = base_url + '?cmd=' + encodeURIComponent(cmd) + (wait ? '&wait=' + wait : '') +
+        (rig ? '&rig=' + encodeURIComponent(rig) : '');
+    http.get(u, { agent: agent }, (res) => {
+        var body = '';
+        res.setEncoding('utf8');
+        res.on('data', (chunk) => { body += chunk; });
+        res.on('end', () => {
+            try {
+                cb(null, JSON.parse(body));
+            } catch (err) {
+                cb(err);
+            }
+        });
+    }).on('error', (err) => cb(err));
+}
+
+// Emergency stop, jumps ahead of anything still queued for the rig
+function send_stop(base_url, rig, cb) {
+    send_cmd(base_url + 'stop', rig, '', null, cb);
+}
+
+// Coordinated move, sync is {"<rig>": [cmds], ...} and every rig starts together
+function send_sync(base_url, sync, lead, wait, cb) {
+    var u = base_url + 'sync?' + (lead ? 'lead=' + lead + '&' : '') + (wait ? 'wait=' + wait : '');
+    var req = http.request(u, { method: 'POST', agent: agent }, (res) => {
+        var body = '';
+        res.setEncoding('utf8');
+        res.on('data', (chunk) => { body += chunk; });
+        res.on('end', () => {
+            try {
+                cb(null, JSON.parse(body));
+            } catch (err) {
+                cb(err);
+            }
+        });
+    });
+    req.on('error', (err) => cb(err));
+    req.end(JSON.stringify(sync));
+}
+
+function record_latency(ms) {
+    latency.count++;
+    latency.total += ms;
+    latency.min = Math.min(latency.min, ms);
+    latency.max = Math.max(latency.max, ms);
+}
 
 async function init() {
-    var url = "http://10.10.10.112:8080/";
-    var input = new easymidi.Input('NewDay-Stream');
-    input.on('noteon', async function (msg) {
-    // do something with msg
-    if (msg.channel == 1) {
-        if (msg.velocity > 0) {
-            if (msg.note == 1) {
-                await sleep(400);
-                request(url + '?cmd=t', { json: true }, (err, res, body) => {});
+    var mapping = load_mapping();
+    var url = mapping.url;
+    var input = new easymidi.Input(mapping.input, VIRTUAL_INPUT);
+    var output = mapping.arrival_output ? new easymidi.Output(mapping.arrival_output) : null;
+    var cc_last = {};
+    var axis_streams = {}; // one joystick socket per rig with mapped axes
+
+    function rig_of(m) {
+        return m.rig !== undefined ? String(m.rig) : (mapping.rig !== undefined ? String(mapping.rig) : '');
+    }
+
+    function axis_stream(m) {
+        var rig = rig_of(m);
+        if (axis_streams[rig] === undefined) {
+            axis_streams[rig] = new AxisStream(url, rig);
+        }
+        return axis_streams[rig];
+    }
+    mapping.axes.forEach(axis_stream);
+
+    console.log('MIDI bridge on %s -> %s (%d notes, %d cc, %d axes)', mapping.input, url,
+        mapping.notes.length, mapping.cc.length, mapping.axes.length);
+
+    // open the connection now so the first cue does not pay for it
+    http.get(url + 'status', { agent: agent }, (res) => res.resume()).on('error', () => {});
+
+    function dispatch(msg, m) {
+        var received = process.hrtime.bigint();
+        var cmd = m.sync ? 'sync ' + Object.keys(m.sync).join(',') : (m.stop ? 'stop' : m.cmd);
+        var rig = rig_of(m);
+
+        function go() {
+            var sent = process.hrtime.bigint();
+            var send = m.sync ? (cb) => send_sync(url, m.sync, m.lead, m.wait, cb) :
+                m.stop ? (cb) => send_stop(url, rig, cb) : (cb) => send_cmd(url, rig, cmd, m.wait, cb);
+            send((err, body) => {
+                var ms = Number(process.hrtime.bigint() - received) / 1e6 - (m.delay || 0);
+                if (err || !body) {
+                    console.error(cmd, err);
+                    return;
+                }
+                if (!body.ok) {
+                    console.log(cmd, 'failed:', body.error);
+                    return;
+                }
+                // a waited reply only comes back on arrival, the server reports when it was acked
+                var ack_ms = m.wait ? Number(sent - received) / 1e6 - (m.delay || 0) + body.ack_ms : ms;
+                record_latency(ack_ms);
+                console.log('%s acked in %s ms', cmd, ack_ms.toFixed(1));
+                if (!m.wait) {
+                    return;
+                }
+                if (!body.arrived) {
+                    console.log(cmd, 'did not arrive:', body.error);
+                    return;
+                }
+                console.log('%s arrived after %s ms', cmd, ms.toFixed(0));
+                if (output) {
+                    output.send('noteon', { note: msg.note, velocity: 127, channel: mapping.arrival_channel });
+                }
+            });
+        }
+
+        if (m.delay > 0) {
+            setTimeout(go, m.delay);
+        } else {
+            go();
+        }
+    }
+
+    input.on('noteon', function (msg) {
+        if (msg.velocity == 0) {
+            return;
+        }
+        mapping.notes.forEach((m) => {
+            if (m.channel == msg.channel && m.note == msg.note) {
+                dispatch(msg, m);
             }
-            if (msg.note == 2) {
-                await sleep(400);
-                request(url + '?cmd=t2', { json: true }, (err, res, body) => {});
+        });
+    });
+
+    // cc mappings fire once each time the value rises through the threshold
+    input.on('cc', function (msg) {
+        var key = msg.channel + ':' + msg.controller;
+        var last = cc_last[key] || 0;
+        cc_last[key] = msg.value;
+        mapping.cc.forEach((m) => {
+            var threshold = m.threshold || 64;
+            if (m.channel == msg.channel && m.controller == msg.controller && last < threshold && msg.value >= threshold) {
+                dispatch(msg, m);
             }
-            if (msg.note == 4) {
-                await sleep(400);
-                request(url + '?cmd=t3', { json: true }, (err, res, body) => {});
+        });
+
+        // 14 bit controllers send the MSB on controller n and the LSB on n + 32
+        mapping.axes.forEach((m) => {
+            if (m.type !== 'cc' || m.channel != msg.channel) {
+                return;
             }
-            if (msg.note == 3) {
-                await sleep(400);
-                request(url + '?cmd=t4', { json: true }, (err, res, body) => {});
+            if (m.controller == msg.controller) {
+                if (m.bits == 14) {
+                    var lsb = cc_last[msg.channel + ':' + (msg.controller + 32)] || 0;
+                    apply_axis(axis_stream(m), m, ((msg.value << 7) | lsb) / 16383);
+                } else {
+                    apply_axis(axis_stream(m), m, msg.value / 127);
+                }
+            } else if (m.bits == 14 && m.controller + 32 == msg.controller) {
+                var msb = cc_last[msg.channel + ':' + m.controller] || 0;
+                apply_axis(axis_stream(m), m, ((msb << 7) | msg.value) / 16383);
             }
-            console.log(msg);
+        });
+    });
+
+    input.on('pitch', function (msg) {
+        mapping.axes.forEach((m) => {
+            if (m.type === 'pitchbend' && m.channel == msg.channel) {
+                apply_axis(axis_stream(m), m, msg.value / 16383);
+            }
+        });
+    });
+
+    process.on('SIGINT', () => {
+        if (latency.count > 0) {
+            console.log('note to ack latency over %d cues: min %s avg %s max %s ms', latency.count,
+                latency.min.toFixed(1), (latency.total / latency.count).toFixed(1), latency.max.toFixed(1));
         }
-    }
+        process.exit(0);
     });
 
     // CAM POS PLAN
@@ -36,10 +318,4 @@ async function init() {
     // Pos 4 = James
 };
 
-function sleep(ms) {
-    return new Promise((resolve) => {
-        setTimeout(resolve, ms);
-    });
-}
-
-init();
\ No newline at end of file
+init();
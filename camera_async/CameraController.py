@@ -1,8 +1,16 @@
 import time
 import sys
+import os
+import json
+import signal
 import threading
+import socketserver
+from collections import deque
 from inputs import get_gamepad
-import serial
+import osc_server
+import visca_server
+import recording
+from rig import Rig, check_cmds, move_boards, host_ms
 
 ARDUINO_PITCH_MAX_SPEED = 10000 * 1.3
 ARDUINO_YAW_MAX_SPEED = 1800 * 4.8
@@ -15,9 +23,10 @@ ARDUINO_YAW_SPEED = 0
 ARDUINO_PITCH_SPEED_LAST = 0
 ARDUINO_YAW_SPEED_LAST = 0
 
-ARDUINO_PITCH_LAST = 0
-ARDUINO_YAW_LAST = 0
-ARDUINO_ZOOM_LAST = 0
+# the gamepad jogs through j like every other client, so recordings see the same stream
+ARDUINO_VELOCITY_LAST = (0, 0, 0)
+GAMEPAD_JOG = {0: 0, 1: 1000, 2: -1000}  # move direction as the old a/b, 1/2 tokens -> permille
+GAMEPAD_ZOOM_JOG = {0: 0, 1: -1000, 2: 1000}  # 4 zoomed out, 5 in
 
 ARDUINO_BACK_LAST = 0
 ARDUINO_START_LAST = 0
@@ -28,46 +37,318 @@ ARDUINO_SELECTED_POS = 1
 
 ARDUINO_ENABLE_SERIAL = True
 
-ARDUINO_PORT = "/dev/ttyACM0"  # put your port here
-ARDUINO_BAUDRATE = 115200
+# one entry per camera head: {"id", "port", "zoom_port", "visca_port", "fov", "limits", "encoders", "backlash"},
+# the first one is the default for commands that name no rig and is the one the gamepad drives.
+# Reloaded on SIGHUP, so heads can be added or removed without a restart.
+RIGS_FILE = os.environ.get("CAMERA_RIGS", os.path.join(os.path.dirname(os.path.abspath(__file__)), "rigs.json"))
+RIGS = {}
+RIG_ORDER = []
+VISCA_SERVERS = {}
+rigs_lock = threading.Lock()
+
+# cmd_server/server.js keeps a connection open here and forwards commands
+CONTROL_HOST = "127.0.0.1"
+CONTROL_PORT = 8081
+
+# show control tools send OSC straight here over UDP, see osc_server.py
+OSC_HOST = "0.0.0.0"
+OSC_PORT = 9000
+
+# PTZ controllers, vMix and OBS speak VISCA over IP, see visca_server.py.
+# Every rig is its own VISCA camera, on its visca_port or VISCA_PORT + its index
+VISCA_HOST = "0.0.0.0"
+VISCA_PORT = 52381
+
+# Coordinated moves across rigs: every board gets @<its own clock time> ahead of the move
+SYNC_LEAD_MS = 250  # default time from sending to starting, every board must have its commands by then
+SYNC_MAX_LEAD_MS = 30000
+SYNC_EARLY_MS = 50  # a move start this long before the scheduled time is some other move
+SYNC_REPORT_TIMEOUT = 60  # s, report whatever arrived by then
+SYNC_MOVES = {}  # id -> {"at": host ms, "edges": {(rig id, board): {"start": host ms, "done": host ms}}}
+SYNC_ID = 0
+sync_lock = threading.Lock()
+
+# move recordings, one <name>.cmrr per take, see recording.py
+RECORDINGS_DIR = os.environ.get(
+    "CAMERA_RECORDINGS", os.path.join(os.path.dirname(os.path.abspath(__file__)), "recordings")
+)
+
+# receive to serial write latency per command source, printed every LATENCY_REPORT_EVERY
+LATENCY = {}
+LATENCY_REPORT_EVERY = 100
+
+
+def find_rig(rig_id=None):
+    """Look up a rig by id, None is the default (first) rig"""
+    with rigs_lock:
+        if rig_id is None:
+            rig_id = RIG_ORDER[0] if RIG_ORDER else None
+        return RIGS.get(str(rig_id))
 
-ARDUINO_ZOOM_PORT = "/dev/ttyACM1"  # put your port here
 
-arduino = None
-arduino_zoom = None
-if ARDUINO_ENABLE_SERIAL:
-    arduino = serial.Serial(ARDUINO_PORT, ARDUINO_BAUDRATE)
-    arduino_zoom = serial.Serial(ARDUINO_ZOOM_PORT, ARDUINO_BAUDRATE)
-    # arduino_zoom = arduino
+def send_cmd(cmd):
+    rig = find_rig()
+    if ARDUINO_ENABLE_SERIAL and rig is not None:
+        rig.send_cmd(cmd)
 
 
-def send_cmd(cmd):
-    if ARDUINO_ENABLE_SERIAL:
-        arduino.write(cmd + b" ")
-        arduino_zoom.write(cmd + b" ")
+def stop_rig():
+    rig = find_rig()
+    if ARDUINO_ENABLE_SERIAL and rig is not None:
+        rig.estop()
 
 
 def tell_cmd(msg):
-    if ARDUINO_ENABLE_SERIAL:
-        msg = msg
-        x = msg.encode("ascii")  # encode n send
-        arduino.write(x)
-        arduino_zoom.write(x)
+    rig = find_rig()
+    if ARDUINO_ENABLE_SERIAL and rig is not None:
+        rig.tell_cmd(msg)
+
+
+def record_latency(source, received):
+    """Track how long a command took from arriving at the controller to leaving on the serial port"""
+    ms = (time.perf_counter() - received) * 1000
+    stats = LATENCY.setdefault(source, {"count": 0, "total": 0.0, "min": ms, "max": ms})
+    stats["count"] += 1
+    stats["total"] += ms
+    stats["min"] = min(stats["min"], ms)
+    stats["max"] = max(stats["max"], ms)
+    if stats["count"] % LATENCY_REPORT_EVERY == 0:
+        print_latency()
 
 
-if ARDUINO_ENABLE_SERIAL:
-    print("Waiting for serial connection...")
-    time.sleep(10)
-    send_cmd(b"0")
-    time.sleep(0.1)
+def print_latency():
+    for source, stats in LATENCY.items():
+        print(
+            "latency %s: %d cmds, min %.2f avg %.2f max %.2f ms"
+            % (source, stats["count"], stats["min"], stats["total"] / stats["count"], stats["max"])
+        )
 
+
+def init_cmds():
     pitch_speed = str(ARDUINO_PITCH_MAX_SPEED).encode()
     yaw_speed = str(ARDUINO_YAW_MAX_SPEED).encode()
+    return [
+        b"0",
+        b"p",  # set pitch step speed (higher is slower)
+        pitch_speed,
+        b"y",  # set yaw step speed
+        yaw_speed,
+    ]
+
+
+def load_rigs():
+    """Start rigs that are new in RIGS_FILE and stop the ones that were removed"""
+    global RIG_ORDER
+    with open(RIGS_FILE) as f:
+        config = json.load(f)
+    wanted = {str(r["id"]): r for r in config}
+    with rigs_lock:
+        for rig_id in list(RIGS):
+            if rig_id not in wanted:
+                print("removing rig", rig_id)
+                RIGS.pop(rig_id).stop()
+                visca = VISCA_SERVERS.pop(rig_id, None)
+                if visca is not None:
+                    visca.shutdown()
+                    visca.server_close()
+        for i, (rig_id, r) in enumerate(wanted.items()):
+            if rig_id in RIGS:
+                continue
+            # a rig is only started once its VISCA port is bound, one that fails is left out
+            # and tried again on the next reload
+            try:
+                print("adding rig", rig_id, r["port"], r["zoom_port"])
+                rig = Rig(
+                    rig_id,
+                    r["port"],
+                    r["zoom_port"],
+                    broadcast,
+                    init_cmds(),
+                    on_move_edge,
+                    fov=r.get("fov"),
+                    limits=r.get("limits"),
+                    keep_out=r.get("keep_out"),
+                    encoders=r.get("encoders"),
+                    backlash=r.get("backlash"),
+                )
+                visca = visca_server.ViscaServer(
+                    (VISCA_HOST, r.get("visca_port", VISCA_PORT + i)),
+                    rig.forward_cmds,
+                    record_latency,
+                    rig.telemetry_snapshot,
+                )
+            except (OSError, ValueError, KeyError, TypeError) as e:
+                print("could not add rig", rig_id, e)
+                continue
+            RIGS[rig_id] = rig
+            if ARDUINO_ENABLE_SERIAL:
+                rig.start()
+            threading.Thread(target=visca.serve_forever, daemon=True).start()
+            VISCA_SERVERS[rig_id] = visca
+        RIG_ORDER = [rig_id for rig_id in wanted if rig_id in RIGS]
+    broadcast({"rigs": RIG_ORDER})
+
+
+def start_sync(rig_cmds, lead):
+    """Start each rig's move lead ms from now, rig_cmds is {rig id: ["d3000", "t2"], ...}.
+    Returns (sync id, None) or (None, error)"""
+    global SYNC_ID
+    if not isinstance(rig_cmds, dict) or not rig_cmds:
+        return None, "invalid sync"
+    try:
+        lead = float(SYNC_LEAD_MS if lead is None else lead)
+    except (TypeError, ValueError):
+        return None, "invalid lead"
+    if not 0 < lead <= SYNC_MAX_LEAD_MS:
+        return None, "invalid lead"
+
+    moves = []
+    for rig_id, cmds in rig_cmds.items():
+        rig = find_rig(rig_id)
+        if rig is None:
+            return None, "unknown rig %s" % rig_id
+        if not isinstance(cmds, list) or check_cmds(cmds) is not None:
+            return None, "invalid cmds for rig %s" % rig_id
+        boards = move_boards(cmds)
+        if not boards:
+            return None, "no move for rig %s" % rig_id
+        if not rig.online or not all(rig.clock[board].synced() for board in boards):
+            return None, "rig %s not ready" % rig_id
+        moves.append((rig, cmds, boards))
+
+    at = host_ms() + lead
+    with sync_lock:
+        SYNC_ID += 1
+        sync_id = SYNC_ID
+        edges = {(rig.id, board): {} for rig, cmds, boards in moves for board in boards}
+        SYNC_MOVES[sync_id] = {"at": at, "edges": edges}
+    for rig, cmds, boards in moves:
+        error = rig.schedule_cmds(cmds, at)
+        if error is not None:
+            with sync_lock:
+                SYNC_MOVES.pop(sync_id, None)
+            return None, "rig %s: %s" % (rig.id, error)
+    if host_ms() > at:
+        print("sync", sync_id, "sent %.1f ms after its start time, raise the lead" % (host_ms() - at))
+
+    timer = threading.Timer(SYNC_REPORT_TIMEOUT, finish_sync, args=(sync_id,))
+    timer.daemon = True
+    timer.start()
+    return sync_id, None
+
+
+def on_move_edge(rig, board, kind, at):
+    """Match a board's timestamped move start/done to the sync move it belongs to"""
+    complete = None
+    with sync_lock:
+        for sync_id in sorted(SYNC_MOVES, reverse=True):
+            sync = SYNC_MOVES[sync_id]
+            edge = sync["edges"].get((rig.id, board))
+            if edge is None or kind in edge:
+                continue
+            if kind == "start" and at < sync["at"] - SYNC_EARLY_MS:
+                continue
+            if kind == "done" and "start" not in edge:
+                continue
+            edge[kind] = at
+            if all("done" in e for e in sync["edges"].values()):
+                complete = sync_id
+            break
+    if complete is not None:
+        finish_sync(complete)
+
+
+def finish_sync(sync_id):
+    """Report how far apart the boards started and landed"""
+    with sync_lock:
+        sync = SYNC_MOVES.pop(sync_id, None)
+    if sync is None:
+        return
+    at = sync["at"]
+    edges = sync["edges"]
+    starts = [e["start"] for e in edges.values() if "start" in e]
+    dones = [e["done"] for e in edges.values() if "done" in e]
+    report = {
+        "type": "sync",
+        "id": sync_id,
+        "complete": len(dones) == len(edges),
+        "start_skew_ms": round(max(starts) - min(starts), 1) if starts else None,
+        "arrive_skew_ms": round(max(dones) - min(dones), 1) if dones else None,
+        "start_error_ms": round(max(abs(s - at) for s in starts), 1) if starts else None,
+        "boards": {
+            "%s/%s" % key: {kind: round(t - at, 1) for kind, t in e.items()} for key, e in edges.items()
+        },
+    }
+    print(
+        "sync %d: start skew %s ms, arrival skew %s ms, worst start error %s ms%s"
+        % (
+            sync_id,
+            report["start_skew_ms"],
+            report["arrive_skew_ms"],
+            report["start_error_ms"],
+            "" if report["complete"] else " (incomplete)",
+        )
+    )
+    broadcast({"evt": report})
+
+
+def record(rig, name):
+    """Start recording rig to RECORDINGS_DIR/<name>.cmrr, a false name only stops the running one"""
+    if rig.recorder is not None:
+        rig.recorder.stop()
+        rig.recorder = None
+    if not name:
+        return None
+    try:
+        path = recording.recording_path(RECORDINGS_DIR, name)
+        os.makedirs(RECORDINGS_DIR, exist_ok=True)
+        rig.recorder = recording.Recorder(rig, path)
+    except (ValueError, OSError) as e:
+        return str(e)
+    print("rig", rig.id, "recording to", path)
+    return None
+
+
+def replay(rig, options):
+    """Replay {"name", "scale", "from_ms", "to_ms"} on rig, false only stops the running replay"""
+    if rig.replayer is not None:
+        rig.replayer.stop()
+        rig.replayer = None
+    if not options:
+        return None
+    if not isinstance(options, dict) or "name" not in options:
+        return "invalid replay"
+    name = options["name"]
+    try:
+        tick_ms, samples = recording.load(recording.recording_path(RECORDINGS_DIR, name))
+        scale = float(options.get("scale", 1))
+        if scale <= 0:
+            return "invalid scale"
+        first = int(options.get("from_ms", 0)) // tick_ms
+        last = options.get("to_ms")
+        last = None if last is None else int(last) // tick_ms + 1
+        rig.replayer = recording.Replayer(
+            rig, samples, tick_ms, scale, first, last, lambda r, error: replay_done(rig, name, r, error)
+        )
+    except (TypeError, ValueError, OSError) as e:
+        return str(e)
+    print("rig", rig.id, "replaying", name, "x%g" % scale)
+    return None
+
+
+def replay_done(rig, name, replayer, error):
+    if rig.replayer is replayer:
+        rig.replayer = None
+    print("rig", rig.id, "replay", name, "done" if error is None else error)
+    broadcast({"rig": rig.id, "evt": {"type": "replay_done", "name": name, "error": error}})
+
+
+def reload_rigs():
+    try:
+        load_rigs()
+    except (OSError, ValueError, KeyError, TypeError) as e:
+        print("could not reload", RIGS_FILE, e)
 
-    send_cmd(b"p")  # set pitch step speed (higher is slower)
-    send_cmd(pitch_speed)
-    send_cmd(b"y")  # set yaw step speed
-    send_cmd(yaw_speed)
 
 JOY_MAX_VALUE = 32768
 JOY_DEADZONE = JOY_MAX_VALUE * 0.06  # deadzone after 9% of max is reached
@@ -103,22 +384,164 @@ JOY_TRIGGER_L = 0
 JOY_TRIGGER_R = 0
 
 
-def thread_function(name):
-    LAST_CMD = ""
-    CUR_CMD = ""
-
-    while True:
-        with open("/home/pi/camera_async/send_cmd.txt", "r") as f:
-            CUR_CMD = f.read().strip()
-            if CUR_CMD != LAST_CMD and CUR_CMD != "":
-                LAST_CMD = CUR_CMD
-                print("send", CUR_CMD)
-                send_cmd(bytes(CUR_CMD, "ascii"))
-        time.sleep(0.05)
+command_clients = set()
+command_clients_lock = threading.Lock()
+
+
+def broadcast(msg):
+    """Push a message (telemetry) to every connected command client"""
+    with command_clients_lock:
+        clients = list(command_clients)
+    for client in clients:
+        client.send_msg(msg)
+
+
+class CommandHandler(socketserver.StreamRequestHandler):
+    # one JSON line per command: {"seq": n, "cmd": "t2"}, {"seq": n, "vel": {...}} or {"seq": n, "target": {...}},
+    # with an optional "rig": id (default is the first rig), answered in order with
+    # {"ack": n, "ok": true} or {"ack": n, "ok": false, "error": "..."}.
+    # {"seq": n, "sync": {rig id: [cmds], ...}, "lead": ms} starts a move on several rigs at
+    # the same moment, its ack carries "sync": id and the skew report follows as
+    # {"evt": {"type": "sync", "id": id, ...}} once every board has landed.
+    # {"seq": n, "record": name | false} starts or stops recording a rig, {"seq": n, "replay":
+    # {"name": name, "scale": s, "from_ms": a, "to_ms": b} | false} plays a recording back
+    # and reports {"rig": id, "evt": {"type": "replay_done", "name": name, "error": null | "..."}}.
+    # {"seq": n, "stop": true} stops every axis at once. It is handled as soon as it is read, the
+    # rig's commands still queued on this connection are dropped with "error": "stopped", and
+    # a preset move cut short is reported as {"type": "stopped", "id": move_id, "slot": n}.
+    # The rig ids are sent as {"rigs": [...]} on connect and whenever they change.
+    # Telemetry is pushed on the same connection as {"rig": id, "tel": {...}}, move
+    # start/arrival as {"rig": id, "evt": {"type": "move" | "arrived", "id": move_id, "slot": n}}
+    # boards coming and going as {"rig": id, "online": bool} and the firmware each board
+    # runs as {"rig": id, "boards": {"main": {"module", "protocol", "build", "caps"}, "zoom": ...}},
+    # with "overruns": {"<task>": n} and "worst_pass_us" once the task counters were read.
+    # Encoders configured in rigs.json report as {"rig": id, "encoders": {"pitch": "on" | "off" | "fault"}}
+    # and a stall, which stops the head, as {"rig": id, "evt": {"type": "stall", "axis", "steps", "encoder"}}
+    disable_nagle_algorithm = True
+
+    def setup(self):
+        super().setup()
+        self.write_lock = threading.Lock()
+        # commands are run in order by a worker, the reader only jumps the queue for stop
+        self.queue = deque()
+        self.queue_cond = threading.Condition()
+
+    def send_msg(self, msg):
+        try:
+            with self.write_lock:
+                self.wfile.write((json.dumps(msg) + "\n").encode())
+        except OSError:
+            pass
+
+    def handle(self):
+        print("command client connected", self.client_address)
+        with command_clients_lock:
+            command_clients.add(self)
+        with rigs_lock:
+            rigs = [RIGS[rig_id] for rig_id in RIG_ORDER]
+        self.send_msg({"rigs": [rig.id for rig in rigs]})
+        for rig in rigs:
+            self.send_msg({"rig": rig.id, "online": rig.online})
+            if rig.boards:
+                self.send_msg({"rig": rig.id, "boards": dict(rig.boards)})
+            if rig.encoders:
+                self.send_msg({"rig": rig.id, "encoders": dict(rig.encoders)})
+            self.send_msg({"rig": rig.id, "tel": rig.telemetry_snapshot()})
+        worker = threading.Thread(target=self.run_queue, daemon=True)
+        worker.start()
+        try:
+            for line in self.rfile:
+                received = time.perf_counter()
+                try:
+                    msg = json.loads(line)
+                except ValueError:
+                    continue
+                if "stop" in msg:
+                    self.drop_queued(find_rig(msg.get("rig")))
+                    self.run_msg(msg, received)
+                    continue
+                with self.queue_cond:
+                    self.queue.append((msg, received))
+                    self.queue_cond.notify()
+        finally:
+            with self.queue_cond:
+                self.queue.append(None)
+                self.queue_cond.notify()
+            with command_clients_lock:
+                command_clients.discard(self)
+        print("command client disconnected", self.client_address)
+
+    def run_queue(self):
+        while True:
+            with self.queue_cond:
+                while not self.queue:
+                    self.queue_cond.wait()
+                item = self.queue.popleft()
+            if item is None:
+                return
+            self.run_msg(*item)
+
+    def drop_queued(self, rig):
+        """Commands for rig that have not gone out yet are stale once it is stopped"""
+        if rig is None:
+            return
+        with self.queue_cond:
+            kept = deque()
+            for item in self.queue:
+                if item is not None and "sync" not in item[0] and find_rig(item[0].get("rig")) is rig:
+                    self.send_msg({"ack": item[0].get("seq"), "ok": False, "error": "stopped"})
+                else:
+                    kept.append(item)
+            self.queue = kept
+
+    def run_msg(self, msg, received):
+        rig = find_rig(msg.get("rig"))
+        sync_id = None
+        if "sync" in msg:
+            sync_id, error = start_sync(msg["sync"], msg.get("lead"))
+        elif rig is None:
+            error = "unknown rig"
+        elif not ARDUINO_ENABLE_SERIAL:
+            error = "serial disabled"
+        elif "stop" in msg:
+            print("stop", rig.id)
+            error = rig.estop()
+        elif "record" in msg:
+            error = record(rig, msg["record"])
+        elif "replay" in msg:
+            error = replay(rig, msg["replay"])
+        elif "vel" in msg:
+            error = rig.send_velocity(msg["vel"])
+        elif "target" in msg:
+            error = rig.send_target(msg["target"])
+        else:
+            print("send", rig.id, msg.get("cmd"))
+            error = rig.forward_cmd(msg.get("cmd"))
+        reply = {"ack": msg.get("seq"), "ok": error is None}
+        if sync_id is not None:
+            reply["sync"] = sync_id
+        if error is not None:
+            reply["error"] = error
+        else:
+            record_latency("tcp", received)
+        self.send_msg(reply)
+
+
+class CommandServer(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+command_server = CommandServer((CONTROL_HOST, CONTROL_PORT), CommandHandler)
+x = threading.Thread(target=command_server.serve_forever, daemon=True)
+x.start()
 
+osc = osc_server.OscServer((OSC_HOST, OSC_PORT), find_rig, record_latency)
+threading.Thread(target=osc.serve_forever, daemon=True).start()
 
-x = threading.Thread(target=thread_function, args=(1,))
-x.start()
+load_rigs()
+# off the main thread, the gamepad loop may be holding rigs_lock when the signal lands
+signal.signal(signal.SIGHUP, lambda signum, frame: threading.Thread(target=reload_rigs, daemon=True).start())
 
 # add zoom via triggers
 while True:
@@ -135,6 +558,8 @@ while True:
                     JOY_BACK = event.state
                 if event.code == "BTN_START":
                     JOY_START = event.state
+                if event.code == "BTN_MODE" and event.state == 1:
+                    stop_rig()  # guide button, stops the head ahead of anything queued
                 if event.code == "BTN_SOUTH":
                     ARDUINO_SELECTED_POS = 1
                 if event.code == "BTN_EAST":
@@ -286,16 +711,6 @@ while True:
                 elif JOY_TRIGGER_R > 0:
                     ZOOM_MOVE = 2
 
-                if ZOOM_MOVE != ARDUINO_ZOOM_LAST:
-                    ARDUINO_ZOOM_LAST = ZOOM_MOVE
-                    if ZOOM_MOVE == 1:
-                        send_cmd(b"4")
-                    elif ZOOM_MOVE == 2:
-                        send_cmd(b"5")
-                    else:
-                        send_cmd(b"6")
-                        send_cmd(b"6")
-
                 # send_cmd(b'p') # set pitch step speed (higher is slower)
                 # send_cmd(pitch_speed)
                 # send_cmd(b'y') # set yaw step speed
@@ -328,25 +743,10 @@ while True:
                     # send_cmd(b'2')
                     # send_cmd(("2" + ARDUINO_YAW_SPEED + ";").encode())
 
-                if ARDUINO_PITCH_LAST != PITCH_MOVE:
-                    ARDUINO_PITCH_LAST = PITCH_MOVE
-                    if PITCH_MOVE == 1:
-                        send_cmd(b"a")
-                    elif PITCH_MOVE == 2:
-                        send_cmd(b"b")
-                    else:
-                        send_cmd(b"c")
-                        send_cmd(b"c")
-
-                if ARDUINO_YAW_LAST != YAW_MOVE:
-                    ARDUINO_YAW_LAST = YAW_MOVE
-                    if YAW_MOVE == 1:
-                        send_cmd(b"1")
-                    elif YAW_MOVE == 2:
-                        send_cmd(b"2")
-                    else:
-                        send_cmd(b"3")
-                        send_cmd(b"3")
+                velocity = (GAMEPAD_JOG[PITCH_MOVE], GAMEPAD_JOG[YAW_MOVE], GAMEPAD_ZOOM_JOG[ZOOM_MOVE])
+                if velocity != ARDUINO_VELOCITY_LAST:
+                    ARDUINO_VELOCITY_LAST = velocity
+                    send_cmd(b"j%d,%d,%d" % velocity)
 
                 # j,pitch,yaw,pitchSpeed,yawSpeed,zoom,zoomSpeed
                 # tell_cmd("j,{pitch},{yaw},{zoom},{pitch_speed}\n".format(pitch = PITCH_MOVE, yaw = YAW_MOVE, zoom = ZOOM_MOVE, pitch_speed = ARDUINO_PITCH_SPEED, yaw_speed = ARDUINO_YAW_SPEED, zoom_speed = ARDUINO_ZOOM_SPEED))
@@ -369,6 +769,7 @@ while True:
                 # print(event.ev_type, event.code, event.state)
 
     except KeyboardInterrupt:
+        print_latency()
         sys.exit(0)
 
 print("done")
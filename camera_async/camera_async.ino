@@ -1,5 +1,33 @@
+#include <EEPROM.h>
+#include <Wire.h>
 #include "SafeStringReader.h"
 
+// Build identity for the hello frame. upload_to_boards.py defines FIRMWARE_HASH
+// from the sketch sources, a build from the IDE reports 0.
+#ifndef FIRMWARE_HASH
+#define FIRMWARE_HASH 0
+#endif
+const int ProtocolVersion = 1;
+
+// Capability bits in the hello frame, the same bits on both boards
+const unsigned int CapTelemetry = 0x01; // pos lines
+const unsigned int CapJog = 0x02; // j velocity
+const unsigned int CapTarget = 0x04; // P/Y absolute targets
+const unsigned int CapTimedMove = 0x08; // d<ms>
+const unsigned int CapClock = 0x10; // k ping, @ scheduled start, timestamped mv lines
+const unsigned int CapFovScale = 0x20; // F<permille> zoom dependent pan/tilt speed
+const unsigned int CapSoftLimits = 0x40; // L<axis><min>,<max>
+const unsigned int CapPositionJournal = 0x80; // position kept across resets after a clean stop
+const unsigned int CapJogDeadman = 0x100; // w<ms>, a jog not refreshed in time ramps to a stop
+const unsigned int CapStopLane = 0x200; // StopByte halts every axis ahead of queued tokens
+const unsigned int CapCredit = 0x400; // cr <limit> flow control
+const unsigned int CapTaskStats = 0x800; // o, answered with ovr <overruns per task>
+const unsigned int CapEncoder = 0x1000; // E<axis><steps per turn>, enc lines
+const unsigned int CapBacklash = 0x2000; // B<axis><steps> taken up on direction reversal
+const unsigned int Capabilities =
+  CapTelemetry | CapJog | CapTarget | CapTimedMove | CapClock | CapFovScale | CapSoftLimits | CapPositionJournal
+  | CapJogDeadman | CapStopLane | CapCredit | CapTaskStats | CapEncoder | CapBacklash;
+
 const int StepX = 2;
 const int DirX = 5;
 const int StepY = 3;
@@ -10,7 +38,113 @@ const int EndstopY = 10;
 
 const int EndstopDefaultPos = 0;
 
-createSafeStringReader(sfReader, 16, " "); // a reader for upto 20 chars to read tokens terminated by space or timeout
+createSafeStringReader(sfReader, 24, " "); // a reader for upto 24 chars to read tokens terminated by space or timeout
+
+// Stop lane. StopByte is never part of a token and the host writes it ahead of
+// anything still queued. The token reader reads through StopInput, which drains the
+// serial buffer at the top of every loop pass: a StopByte stops every axis right
+// there, and whatever arrived before it is dropped unread. The RX interrupt belongs
+// to the core's HardwareSerial, so this is as early as the sketch can see a byte.
+const uint8_t StopByte = 0x18; // CAN
+const int StopInputSize = 64;
+
+// Credit. StopInput counts every byte the token reader takes out of it and the board
+// reports cr <count + CreditWindow> (mod 2^16), the host never writes past that. All
+// that is written but not read yet then fits the core's RX ring, less one byte kept
+// free for a StopByte, and fits StopInput's buffer too, so poll() always empties the
+// ring and a StopByte never waits behind a backlog. A stop restarts the count on both ends.
+const unsigned int CreditWindow = SERIAL_RX_BUFFER_SIZE - 2;
+const unsigned int CreditBatch = 16; // bytes taken before a report while more are waiting
+
+class StopInput : public Stream {
+public:
+  // true when a StopByte came in since the last poll
+  bool poll()
+  {
+    bool stop = false;
+    while (Serial.available() > 0) {
+      int c = Serial.read();
+      if (c == StopByte) {
+        start = 0;
+        count = 0;
+        taken = 0;
+        stop = true;
+      } else if (count < StopInputSize) {
+        buffer[(start + count) % StopInputSize] = c;
+        count++;
+      }
+      // else dropped, only a host writing past its credit fills the buffer and the
+      // ring is still scanned for the StopByte that would drop it anyway
+    }
+    return stop;
+  }
+  int available() { return count; }
+  int peek() { return count > 0 ? buffer[start] : -1; }
+  int read()
+  {
+    if (count == 0) {
+      return -1;
+    }
+    uint8_t c = buffer[start];
+    start = (start + 1) % StopInputSize;
+    count--;
+    taken++;
+    return c;
+  }
+  size_t write(uint8_t c) { return Serial.write(c); }
+  // bytes read since boot or the last StopByte, wraps like the host's count
+  unsigned int taken_count() { return taken; }
+
+private:
+  uint8_t buffer[StopInputSize];
+  int start = 0;
+  int count = 0;
+  unsigned int taken = 0;
+};
+StopInput SerialInput;
+unsigned int CreditReported = 0; // taken count in the last cr line
+
+// Transmit queue. Replies and events are printed to Tx, and loop() moves them on to the
+// core's TX ring (which its UDRE interrupt sends) only as far as that has room, so a
+// print never waits for the wire. They are never dropped: only with TxQueueSize bytes
+// still waiting does a print wait for room like Serial would. Telemetry is kept out of
+// the queue, see handle_tx().
+const int TxQueueSize = 128;
+
+class TxQueue : public Print {
+public:
+  using Print::write;
+  size_t write(uint8_t c)
+  {
+    if (count == TxQueueSize) {
+      Serial.write(pop());
+    }
+    buffer[(start + count) % TxQueueSize] = c;
+    count++;
+    return 1;
+  }
+  // true once everything queued is with the core
+  bool drain()
+  {
+    while (count > 0 && Serial.availableForWrite() > 0) {
+      Serial.write(pop());
+    }
+    return count == 0;
+  }
+
+private:
+  uint8_t pop()
+  {
+    uint8_t c = buffer[start];
+    start = (start + 1) % TxQueueSize;
+    count--;
+    return c;
+  }
+  uint8_t buffer[TxQueueSize];
+  int start = 0;
+  int count = 0;
+};
+TxQueue Tx;
 
 // millisDelay pitchDelay;
 // millisDelay yawDelay;
@@ -22,12 +156,37 @@ createSafeStringReader(sfReader, 16, " "); // a reader for upto 20 chars to read
 
 
 
+const int SetpointDirect = 5; // absolute target from P/Y rather than a stored preset
+
 int BlockUserInput = 0;
 int SetpointStarted = 0;
-int StoredPitchSpeed = 2000 * 1.5;
-int StoredYawSpeed = 2000 * 1;
+long StoredPitchSpeed = 2000 * 1.5;
+long StoredYawSpeed = 2000 * 1;
 int TargetPitchPos = 0;
 int TargetYawPos = 0;
+
+// Soft limits (Lp<min>,<max> and Ly<min>,<max>), off until the host sends them.
+// Approaching a limit the step period is stretched so the axis could still stop on it
+// at LimitDecel, so jogs can run at full speed right up to the end.
+const long LimitRampSteps = 1000; // further out than this no speed needs slowing
+const long PitchLimitDecel = 4000; // steps/s^2
+const long YawLimitDecel = 1000;
+int PitchLimitMin = -32768;
+int PitchLimitMax = 32767;
+int YawLimitMin = -32768;
+int YawLimitMax = 32767;
+
+// Backlash (Bp<steps> and By<steps>), off until the host sends it. An axis that turns
+// round first steps through the gear slack at the move's own rate without counting
+// those steps, so a position is reached at the same spot from either side. Before the
+// first step after a reset the side of the slack is unknown and nothing is taken up.
+const int MaxBacklash = 1000;
+int PitchBacklash = 0;
+int YawBacklash = 0;
+int PitchLastMove = 0; // direction of the last step, 0 before the first
+int YawLastMove = 0;
+int PitchTakeUp = 0; // slack steps left before the position counts again
+int YawTakeUp = 0;
 int StoredPitchPos = 0;
 int StoredYawPos = 0;
 int StoredPitchPosB = 0;
@@ -37,6 +196,104 @@ int StoredYawPosC = 0;
 int StoredPitchPosD = 0;
 int StoredYawPosD = 0;
 
+// Jog velocity (j<pitch>,<yaw>,<zoom> in permille) scales these step delays
+const long JogMaxDelay = 16000; // slowest jog delay
+long JogPitchSpeed = 2000;
+long JogYawSpeed = 1800 * 4;
+long JogPitch = 0; // last j velocity, reapplied when the field of view changes mid jog
+long JogYaw = 0;
+
+// Jog deadman (w<ms>, 0 is off). Once the host turns it on a jog has to be repeated
+// within JogTimeout, otherwise it is taken as a hung host or a lost j0 and the velocity
+// is ramped down by JogStopStep every JogStopTick: worst case stop is JogTimeout + 100 ms.
+unsigned long JogTimeout = 0; // ms
+const unsigned long JogStopTick = 10; // ms, the deadman task's period
+const long JogStopStep = 100; // permille per tick
+unsigned long JogRefreshed = 0;
+
+// Field of view relative to the wide end (F<permille>), relayed by the host from the
+// zoom board's position. Jog and preset speeds are scaled by it so the picture moves
+// at the same rate at any zoom, timed moves keep their duration.
+const long FovScaleMin = 50;
+long FovScale = 1000;
+
+// Timed moves (d<ms> before t/P/Y) pick step delays so both axes land together
+const int StepPulseWidth = 4; // us, comfortably above the driver minimum
+const long FastestPitchSpeed = 2000; // timed moves never step faster than the jog/preset speeds
+const long FastestYawSpeed = 2000;
+unsigned long MoveDuration = 0; // ms, cleared when the move arrives
+
+// Scheduled start (@<ms> before t/P/Y): the move is loaded right away but held
+// until millis() reaches the given board time, so several boards start together
+const unsigned long MaxScheduleAhead = 60000; // ms, anything further out is a bad clock offset
+int StartScheduled = 0;
+unsigned long ScheduledStart = 0;
+
+// Position telemetry (pos <pitch> <yaw> <setpoint>), only sent while something changes
+const unsigned long TelemetryInterval = 20; // ms, one report per host control tick
+char TelemetryFrame[24] = ""; // newest pos line not sent yet, a newer one replaces it
+int TelemetryForce = 0;
+int LastReportedPitchPos = 0;
+int LastReportedYawPos = 0;
+int LastReportedSetpoint = 0;
+
+// Position journal, so a reset does not lose where the head is. Once the head has been
+// still for JournalIdle the position goes into the next record of a ring spanning the
+// whole EEPROM (one record per stop, each cell is written once every JournalSlots stops).
+// The record's valid byte is cleared in place the moment the head moves again, so only
+// a position taken at a clean stop is restored at boot. A record is written one byte
+// per journal tick, an EEPROM write takes 3.3 ms and the task never waits for one: the
+// record it replaces is invalidated first, then its own valid byte is cleared, the rest
+// written and valid set last, so neither a half written nor a replaced record is valid.
+struct PositionRecord {
+  uint8_t magic;
+  uint8_t valid; // not covered by check, it is cleared on its own
+  uint16_t seq;
+  int16_t pitch;
+  int16_t yaw;
+  uint8_t check;
+};
+const uint8_t JournalMagic = 0xC5;
+const int JournalSlots = (E2END + 1) / sizeof(PositionRecord);
+const unsigned long JournalIdle = 1000; // ms
+const unsigned long JournalTick = 5; // ms, longer than an EEPROM write
+int JournalSlot = -1; // record of the last write, -1 while the EEPROM holds none
+uint16_t JournalSeq = 0;
+int JournalValid = 0;
+PositionRecord JournalRecord; // being written, JournalSlot moves on to its slot at the first step
+int JournalStep = -1; // next byte of JournalRecord, -1 while none is under way
+int JournalPitchPos = 0;
+int JournalYawPos = 0;
+unsigned long JournalIdleSince = 0;
+
+// Encoder feedback, optional per axis: an AS5600 magnetic encoder on the motor shaft read
+// over I2C. The AS5600 only answers at 0x36, so the second axis takes an AS5600L. The host
+// turns an axis' encoder on with E<axis><steps per turn>, negative when it counts against
+// the steps, 0 is off. From then on the angle is unwrapped into a position in steps, the
+// step count at that moment being its origin, and compared with the step count every
+// other EncoderTick. A moving axis off by more than EncoderStallSteps full steps has
+// stalled and every axis stops, a still one off by a full step or more was pushed or
+// lost steps and takes the encoder's position, so the next target lands where it should.
+const uint8_t PitchEncoderAddress = 0x36; // AS5600
+const uint8_t YawEncoderAddress = 0x40; // AS5600L
+const uint8_t EncoderStatus = 0x0B;
+const uint8_t EncoderMagnetDetected = 0x20;
+const uint8_t EncoderRawAngle = 0x0C; // 12 bits, high byte first
+const long EncoderCounts = 4096; // per turn
+const long FullStepsPerTurn = 200;
+const long EncoderStallSteps = 3; // full steps, more than the lag of a loaded motor
+const unsigned long EncoderTick = 5; // ms, one axis per tick
+struct Encoder {
+  uint8_t address;
+  long stepsPerTurn; // 0 while off
+  int raw; // last angle read
+  long counts; // angle travelled since it was turned on
+  int origin; // step count when it was turned on
+};
+Encoder PitchEncoder = { PitchEncoderAddress, 0, 0, 0, 0 };
+Encoder YawEncoder = { YawEncoderAddress, 0, 0, 0, 0 };
+int EncoderTurn = 0; // axis read on the next tick, 0 pitch 1 yaw
+
 void setup()
 {
   pinMode(StepX, OUTPUT);
@@ -48,17 +305,26 @@ void setup()
   // pinMode(EndstopY, INPUT_PULLUP);
 
   Serial.begin(115200); // begin transmission
+  Wire.begin();
+  Wire.setClock(400000);
+  Wire.setWireTimeout(1000, true); // a stuck bus fails the read instead of the loop
   SafeString::setOutput(Serial);
   sfReader.setTimeout(1000); // set 1 sec timeout
   sfReader.flushInput(); // empty Serial RX buffer and then skip until either find delimiter or timeout
-  sfReader.connect(Serial); // read from Serial
+  sfReader.connect(SerialInput); // read from Serial, past the stop lane
+
+  journal_restore();
+  start_tasks();
 }
 
 int iStepperSpeedRamp = 0;
 
-int iStepperPitchSpeed = 2000;
+// Steps are timed against micros() like the zoom board so the axes no longer
+// wait on each other's delays, pitch speed is the full step period
+long iStepperPitchSpeed = 2000;
 int iStepperPitchMove = 0;
 int iStepperPitchPos = EndstopDefaultPos; // 10000 is default zero pos
+unsigned long PitchStepTimer = 0;
 void handle_pitch_stepper() {
   if (BlockUserInput > 0) {
     return;
@@ -73,12 +339,22 @@ void handle_pitch_stepper() {
     digitalWrite(DirX, LOW); // set direction, HIGH for clockwise, LOW for anticlockwise
   }
 
-  if (iStepperPitchMove != 0) {
+  if (iStepperPitchMove == 0) {
+    return;
+  }
+  long left = (iStepperPitchMove == 1) ? (long)PitchLimitMax - iStepperPitchPos : (long)iStepperPitchPos - PitchLimitMin;
+  unsigned long period = limit_period(iStepperPitchSpeed, left, PitchLimitDecel);
+  if (period != 0 && (micros() - PitchStepTimer) >= period) {
+    PitchStepTimer = micros();
+    PitchTakeUp = slack_ahead(iStepperPitchMove, PitchLastMove, PitchTakeUp, PitchBacklash);
+    PitchLastMove = iStepperPitchMove;
     digitalWrite(StepX, HIGH);
-    delayMicroseconds(iStepperPitchSpeed / 2);
+    delayMicroseconds(StepPulseWidth);
     digitalWrite(StepX, LOW);
-    delayMicroseconds(iStepperPitchSpeed / 2);
-    if (iStepperPitchMove == 1) {
+    if (PitchTakeUp > 0) {
+      PitchTakeUp--;
+      PitchEncoder.origin += (iStepperPitchMove == 1) ? -1 : 1; // the motor turned, the head did not
+    } else if (iStepperPitchMove == 1) {
       iStepperPitchPos += 1;
     } else if (iStepperPitchMove == 2) {
       iStepperPitchPos -= 1;
@@ -86,9 +362,39 @@ void handle_pitch_stepper() {
   }
 }
 
-int iStepperYawSpeed = 1800 * 4;
+// Slack steps ahead of an axis stepping in direction move: what is left of a take-up
+// going the same way, or after a reversal all of the backlash less the part of a
+// take-up cut short by it that was not stepped yet
+int slack_ahead(int move, int lastMove, int takeUp, int backlash)
+{
+  if (move == lastMove) {
+    return takeUp;
+  }
+  if (lastMove == 0) {
+    return 0;
+  }
+  return max(backlash - takeUp, 0);
+}
+
+// Step period (us) toward a soft limit left steps away: the normal period, or longer
+// so the axis can still stop on the limit at decel. 0 means the axis is on the limit.
+unsigned long limit_period(unsigned long period, long left, long decel)
+{
+  if (left <= 0) {
+    return 0;
+  }
+  if (left >= LimitRampSteps) {
+    return period;
+  }
+  unsigned long slowest = 1000000.0 / sqrt(2.0 * decel * left);
+  return max(period, slowest);
+}
+
+// yaw speed is half the step period (the old high + low delays)
+long iStepperYawSpeed = 1800 * 4;
 int iStepperYawMove = 0;
 int iStepperYawPos = EndstopDefaultPos;
+unsigned long YawStepTimer = 0;
 void handle_yaw_stepper() {
   if (BlockUserInput > 0) {
     return;
@@ -103,12 +409,22 @@ void handle_yaw_stepper() {
     digitalWrite(DirY, LOW); // set direction, HIGH for clockwise, LOW for anticlockwise
   }
 
-  if (iStepperYawMove != 0) {
+  if (iStepperYawMove == 0) {
+    return;
+  }
+  long left = (iStepperYawMove == 1) ? (long)YawLimitMax - iStepperYawPos : (long)iStepperYawPos - YawLimitMin;
+  unsigned long period = limit_period(2UL * iStepperYawSpeed, left, YawLimitDecel);
+  if (period != 0 && (micros() - YawStepTimer) >= period) {
+    YawStepTimer = micros();
+    YawTakeUp = slack_ahead(iStepperYawMove, YawLastMove, YawTakeUp, YawBacklash);
+    YawLastMove = iStepperYawMove;
     digitalWrite(StepY, HIGH);
-    delayMicroseconds(iStepperYawSpeed);
+    delayMicroseconds(StepPulseWidth);
     digitalWrite(StepY, LOW);
-    delayMicroseconds(iStepperYawSpeed);
-    if (iStepperYawMove == 1) {
+    if (YawTakeUp > 0) {
+      YawTakeUp--;
+      YawEncoder.origin += (iStepperYawMove == 1) ? -1 : 1;
+    } else if (iStepperYawMove == 1) {
       iStepperYawPos += 1;
     } else if (iStepperYawMove == 2) {
       iStepperYawPos -= 1;
@@ -118,24 +434,142 @@ void handle_yaw_stepper() {
   
 }
 
+// Move events are sent the moment they happen, telemetry only every TelemetryInterval.
+// The board time lets the host line up moves across boards.
+void report_move(const char *event, int setpoint)
+{
+  Tx.print("mv ");
+  Tx.print(event);
+  Tx.print(" ");
+  Tx.print(setpoint);
+  Tx.print(" ");
+  Tx.println(millis());
+}
+
+void report_credit()
+{
+  CreditReported = SerialInput.taken_count();
+  Tx.print("cr ");
+  Tx.println(CreditReported + CreditWindow);
+}
+
+// Report credit once the input is all read, or every CreditBatch bytes while it keeps coming
+void handle_credit()
+{
+  unsigned int unreported = SerialInput.taken_count() - CreditReported;
+  if (unreported == 0 || (unreported < CreditBatch && SerialInput.available() > 0)) {
+    return;
+  }
+  report_credit();
+}
+
+// Spread each axis over MoveDuration so both land at the same time
+void apply_move_duration()
+{
+  if (MoveDuration == 0) {
+    return;
+  }
+
+  long pitchSteps = labs((long)TargetPitchPos - iStepperPitchPos);
+  long yawSteps = labs((long)TargetYawPos - iStepperYawPos);
+  // slack taken up on the way is part of the move, not extra time after it
+  if (pitchSteps > 0) {
+    pitchSteps += slack_ahead((TargetPitchPos > iStepperPitchPos) ? 1 : 2, PitchLastMove, PitchTakeUp, PitchBacklash);
+  }
+  if (yawSteps > 0) {
+    yawSteps += slack_ahead((TargetYawPos > iStepperYawPos) ? 1 : 2, YawLastMove, YawTakeUp, YawBacklash);
+  }
+  if (pitchSteps > 0) {
+    iStepperPitchSpeed = max((long)(MoveDuration * 1000 / pitchSteps), FastestPitchSpeed);
+    PitchStepTimer = micros();
+  }
+  if (yawSteps > 0) {
+    iStepperYawSpeed = max((long)(MoveDuration * 1000 / yawSteps / 2), FastestYawSpeed);
+    YawStepTimer = micros();
+  }
+}
+
+void start_setpoint(int setpoint)
+{
+  SetpointStarted = setpoint;
+  JogPitch = 0;
+  JogYaw = 0;
+  iStepperPitchSpeed = fov_delay(2000 * 1.5);
+  iStepperYawSpeed = fov_delay(2000 * 1);
+  load_setpoint_target();
+  if (!StartScheduled) {
+    apply_move_duration();
+    report_move("start", SetpointStarted);
+  } else {
+    hold_for_start();
+  }
+}
+
+// Absolute move of one axis, the other axis holds unless it already has a direct target
+void start_direct_move(int *target, int pos)
+{
+  int started = SetpointStarted == SetpointDirect;
+  if (!started) {
+    TargetPitchPos = iStepperPitchPos;
+    TargetYawPos = iStepperYawPos;
+    JogPitch = 0;
+    JogYaw = 0;
+    iStepperPitchSpeed = fov_delay(2000 * 1.5);
+    iStepperYawSpeed = fov_delay(2000 * 1);
+  }
+  *target = pos;
+  SetpointStarted = SetpointDirect;
+  if (!StartScheduled) {
+    apply_move_duration();
+    if (!started) {
+      report_move("start", SetpointStarted);
+    }
+  } else {
+    hold_for_start();
+  }
+}
+
+// A scheduled move waits standing still, a jog or move under way stops where it is
+void hold_for_start()
+{
+  iStepperPitchMove = 0;
+  iStepperYawMove = 0;
+}
+
+void load_setpoint_target()
+{
+  if (SetpointStarted == 1) {
+    TargetPitchPos = StoredPitchPos;
+    TargetYawPos = StoredYawPos;
+  } else if (SetpointStarted == 2) {
+    TargetPitchPos = StoredPitchPosB;
+    TargetYawPos = StoredYawPosB;
+  } else if (SetpointStarted == 3) {
+    TargetPitchPos = StoredPitchPosC;
+    TargetYawPos = StoredYawPosC;
+  } else if (SetpointStarted == 4) {
+    TargetPitchPos = StoredPitchPosD;
+    TargetYawPos = StoredYawPosD;
+  } // SetpointDirect keeps the targets it was given
+  TargetPitchPos = constrain(TargetPitchPos, PitchLimitMin, PitchLimitMax);
+  TargetYawPos = constrain(TargetYawPos, YawLimitMin, YawLimitMax);
+}
+
 void handle_setpoint_motion() 
 {
   if (SetpointStarted > 0) {
+    if (StartScheduled) {
+      if ((long)(millis() - ScheduledStart) < 0) {
+        return;
+      }
+      StartScheduled = 0;
+      apply_move_duration();
+      report_move("start", SetpointStarted);
+    }
+
     BlockUserInput = 1;
 
-    if (SetpointStarted == 1) {
-      TargetPitchPos = StoredPitchPos;
-      TargetYawPos = StoredYawPos;
-    } else if (SetpointStarted == 2) {
-      TargetPitchPos = StoredPitchPosB;
-      TargetYawPos = StoredYawPosB;
-    } else if (SetpointStarted == 3) {
-      TargetPitchPos = StoredPitchPosC;
-      TargetYawPos = StoredYawPosC;
-    } else if (SetpointStarted == 4) {
-      TargetPitchPos = StoredPitchPosD;
-      TargetYawPos = StoredYawPosD;
-    }
+    load_setpoint_target();
     
     if (iStepperPitchPos == TargetPitchPos) {
       iStepperPitchMove = 0;
@@ -148,7 +582,9 @@ void handle_setpoint_motion()
     }
 
     if ((iStepperPitchPos == TargetPitchPos) && (iStepperYawPos == TargetYawPos)) {
+      report_move("done", SetpointStarted);
       SetpointStarted = 0;
+      MoveDuration = 0;
       BlockUserInput = 0;
       iStepperPitchMove = 0;
       iStepperYawMove = 0;
@@ -210,6 +646,336 @@ int ZeroStepperStarted = 0;
 //   }
 // }
 
+// Map a signed permille velocity onto a direction and a step delay
+long jog_delay(long base, long velocity) {
+  if (velocity < 0) {
+    velocity = -velocity;
+  }
+  long d = base * 1000 / velocity;
+  if (d > JogMaxDelay) {
+    d = JogMaxDelay;
+  }
+  return d;
+}
+
+// Stretch a step delay for the current field of view
+long fov_delay(long d) {
+  return d * 1000 / FovScale;
+}
+
+void handle_jog(long pitch, long yaw) {
+  JogPitch = pitch;
+  JogYaw = yaw;
+  if (pitch > 0) {
+    iStepperPitchMove = 1;
+    iStepperPitchSpeed = fov_delay(jog_delay(JogPitchSpeed, pitch));
+  } else if (pitch < 0) {
+    iStepperPitchMove = 2;
+    iStepperPitchSpeed = fov_delay(jog_delay(JogPitchSpeed, pitch));
+  } else {
+    iStepperPitchMove = 0;
+    iStepperPitchSpeed = JogPitchSpeed;
+  }
+
+  if (yaw > 0) {
+    iStepperYawMove = 1;
+    iStepperYawSpeed = fov_delay(jog_delay(JogYawSpeed, yaw));
+  } else if (yaw < 0) {
+    iStepperYawMove = 2;
+    iStepperYawSpeed = fov_delay(jog_delay(JogYawSpeed, yaw));
+  } else {
+    iStepperYawMove = 0;
+    iStepperYawSpeed = JogYawSpeed;
+  }
+}
+
+uint8_t journal_check(const PositionRecord &record)
+{
+  const uint8_t *bytes = (const uint8_t *)&record;
+  uint8_t check = 0x5A;
+  for (unsigned int i = 0; i < offsetof(PositionRecord, check); i++) {
+    if (i != offsetof(PositionRecord, valid)) {
+      check = ((check << 1) | (check >> 7)) ^ bytes[i];
+    }
+  }
+  return check;
+}
+
+// Pick up the newest record, its position only if the head stopped cleanly before the reset
+void journal_restore()
+{
+  PositionRecord newest = {};
+  for (int i = 0; i < JournalSlots; i++) {
+    PositionRecord record;
+    EEPROM.get(i * sizeof(PositionRecord), record);
+    if (record.magic != JournalMagic || record.check != journal_check(record)) {
+      continue;
+    }
+    if (JournalSlot < 0 || (int16_t)(record.seq - newest.seq) > 0) {
+      newest = record;
+      JournalSlot = i;
+    }
+  }
+  if (JournalSlot < 0) {
+    return;
+  }
+  JournalSeq = newest.seq;
+  if (newest.valid == 1) {
+    iStepperPitchPos = TargetPitchPos = JournalPitchPos = newest.pitch;
+    iStepperYawPos = TargetYawPos = JournalYawPos = newest.yaw;
+    JournalValid = 1;
+  }
+}
+
+void journal_begin()
+{
+  JournalSeq++;
+  JournalRecord.magic = JournalMagic;
+  JournalRecord.valid = 1;
+  JournalRecord.seq = JournalSeq;
+  JournalRecord.pitch = iStepperPitchPos;
+  JournalRecord.yaw = iStepperYawPos;
+  JournalRecord.check = journal_check(JournalRecord);
+  JournalPitchPos = iStepperPitchPos;
+  JournalYawPos = iStepperYawPos;
+  JournalStep = 0;
+}
+
+// Write the next byte of the record if the EEPROM is free: the last record's valid
+// cleared and the next slot taken, its valid cleared, the other bytes in order, valid set
+void journal_step()
+{
+  if (!eeprom_is_ready()) {
+    return;
+  }
+  const int valid = offsetof(PositionRecord, valid);
+  if (JournalStep == 0) {
+    // an encoder fix moves a still head, a reset before the new record is
+    // complete must not bring back the old position
+    if (JournalValid) {
+      EEPROM.update(JournalSlot * sizeof(PositionRecord) + valid, 0);
+      JournalValid = 0;
+    }
+    JournalSlot = (JournalSlot + 1) % JournalSlots;
+    JournalStep++;
+    return;
+  }
+  int base = JournalSlot * sizeof(PositionRecord);
+  if (JournalStep == 1) {
+    EEPROM.update(base + valid, 0);
+  } else if (JournalStep <= (int)sizeof(PositionRecord)) {
+    int i = (JournalStep - 1 <= valid) ? JournalStep - 2 : JournalStep - 1;
+    EEPROM.update(base + i, ((const uint8_t *)&JournalRecord)[i]);
+  } else {
+    EEPROM.update(base + valid, 1);
+    JournalStep = -1;
+    JournalValid = 1;
+    return;
+  }
+  JournalStep++;
+}
+
+// Runs before the steppers on every pass, so the record is invalid before the first
+// step of a move, or within one EEPROM write of it when the journal task was writing
+void journal_guard()
+{
+  if (iStepperPitchMove == 0 && iStepperYawMove == 0 && SetpointStarted == 0) {
+    return;
+  }
+  JournalIdleSince = millis();
+  JournalStep = -1; // a record under way is left with its valid byte clear
+  // never wait out a journal write here, the clear is tried again on the next pass
+  if (JournalValid && eeprom_is_ready()) {
+    EEPROM.update(JournalSlot * sizeof(PositionRecord) + offsetof(PositionRecord, valid), 0);
+    JournalValid = 0;
+  }
+}
+
+void handle_journal()
+{
+  if (JournalStep >= 0) {
+    journal_step();
+    return;
+  }
+  if (iStepperPitchMove != 0 || iStepperYawMove != 0 || SetpointStarted != 0
+      || millis() - JournalIdleSince < JournalIdle) {
+    return;
+  }
+  if (!JournalValid || iStepperPitchPos != JournalPitchPos || iStepperYawPos != JournalYawPos) {
+    journal_begin();
+  }
+}
+
+// Every axis stops on the spot, moves, jogs and anything scheduled are dropped
+void stop_motion()
+{
+  int stopped = SetpointStarted;
+  iStepperPitchMove = 0;
+  iStepperYawMove = 0;
+  JogPitch = 0;
+  JogYaw = 0;
+  TargetPitchPos = iStepperPitchPos;
+  TargetYawPos = iStepperYawPos;
+  SetpointStarted = 0;
+  StartScheduled = 0;
+  MoveDuration = 0;
+  BlockUserInput = 0;
+  iStepperPitchSpeed = StoredPitchSpeed;
+  iStepperYawSpeed = StoredYawSpeed;
+  report_move("stop", stopped);
+}
+
+// Stop lane
+void emergency_stop()
+{
+  stop_motion();
+  sfReader.clear(); // a token cut in half by the stop
+  report_credit(); // the host waits for the restarted count after mv stop
+}
+
+long jog_ramp_down(long velocity)
+{
+  if (velocity > 0) {
+    return max(velocity - JogStopStep, 0L);
+  }
+  return min(velocity + JogStopStep, 0L);
+}
+
+void handle_jog_deadman()
+{
+  if (JogTimeout == 0 || (JogPitch == 0 && JogYaw == 0) || millis() - JogRefreshed < JogTimeout) {
+    return;
+  }
+  handle_jog(jog_ramp_down(JogPitch), jog_ramp_down(JogYaw));
+}
+
+// enc on|off|fault|fix|stall <axis> <step count> <encoder position>
+void report_encoder(const char *event, char axis, long pos, long measured)
+{
+  Tx.print("enc ");
+  Tx.print(event);
+  Tx.print(" ");
+  Tx.print(axis);
+  Tx.print(" ");
+  Tx.print(pos);
+  Tx.print(" ");
+  Tx.println(measured);
+}
+
+// count bytes of an encoder register, high byte first, -1 if the encoder did not answer
+long encoder_register(uint8_t address, uint8_t reg, uint8_t count)
+{
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  if (Wire.endTransmission(false) != 0 || Wire.requestFrom(address, count) != count) {
+    return -1;
+  }
+  long value = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    value = (value << 8) | Wire.read();
+  }
+  return value;
+}
+
+void encoder_setup(Encoder &encoder, char axis, long stepsPerTurn, int pos)
+{
+  encoder.stepsPerTurn = 0;
+  if (stepsPerTurn == 0) {
+    report_encoder("off", axis, pos, pos);
+    return;
+  }
+  long status = encoder_register(encoder.address, EncoderStatus, 1);
+  long raw = encoder_register(encoder.address, EncoderRawAngle, 2);
+  if (status < 0 || !(status & EncoderMagnetDetected) || raw < 0) {
+    report_encoder("fault", axis, pos, pos);
+    return;
+  }
+  encoder.stepsPerTurn = stepsPerTurn;
+  encoder.raw = raw & (EncoderCounts - 1);
+  encoder.counts = 0;
+  encoder.origin = pos;
+  report_encoder("on", axis, pos, pos);
+}
+
+// Read one encoder and hold its axis against it, 1 when the axis stalled
+int encoder_check(Encoder &encoder, char axis, int &pos, int moving)
+{
+  if (encoder.stepsPerTurn == 0) {
+    return 0;
+  }
+  long raw = encoder_register(encoder.address, EncoderRawAngle, 2);
+  if (raw < 0) {
+    encoder.stepsPerTurn = 0; // back to open loop
+    report_encoder("fault", axis, pos, pos);
+    return 0;
+  }
+  // shortest way round from the last angle, the axis turns far less than half a turn per read
+  int delta = (((int)raw - encoder.raw) & (EncoderCounts - 1));
+  if (delta >= EncoderCounts / 2) {
+    delta -= EncoderCounts;
+  }
+  encoder.raw = raw & (EncoderCounts - 1);
+  encoder.counts += delta;
+
+  long travelled = encoder.counts * encoder.stepsPerTurn;
+  travelled = (travelled + (travelled < 0 ? -EncoderCounts / 2 : EncoderCounts / 2)) / EncoderCounts;
+  long measured = constrain(encoder.origin + travelled, -32768L, 32767L);
+  long error = labs(measured - pos);
+  long fullStep = max(labs(encoder.stepsPerTurn) / FullStepsPerTurn, 1L);
+  if (moving ? error <= EncoderStallSteps * fullStep : error < fullStep) {
+    return 0;
+  }
+  report_encoder(moving ? "stall" : "fix", axis, pos, measured);
+  pos = measured;
+  return moving;
+}
+
+// Encoder task, pitch and yaw in turn so a pass waits for one I2C read at most
+void handle_encoders()
+{
+  int stalled;
+  if (EncoderTurn == 0) {
+    stalled = encoder_check(PitchEncoder, 'p', iStepperPitchPos, iStepperPitchMove != 0);
+  } else {
+    stalled = encoder_check(YawEncoder, 'y', iStepperYawPos, iStepperYawMove != 0);
+  }
+  EncoderTurn = !EncoderTurn;
+  if (stalled) {
+    stop_motion();
+  }
+}
+
+void handle_telemetry()
+{
+  if (!TelemetryForce && iStepperPitchPos == LastReportedPitchPos && iStepperYawPos == LastReportedYawPos
+      && SetpointStarted == LastReportedSetpoint) {
+    return;
+  }
+  TelemetryForce = 0;
+  LastReportedPitchPos = iStepperPitchPos;
+  LastReportedYawPos = iStepperYawPos;
+  LastReportedSetpoint = SetpointStarted;
+
+  snprintf(TelemetryFrame, sizeof(TelemetryFrame), "pos %d %d %d\r\n", iStepperPitchPos, iStepperYawPos,
+    SetpointStarted);
+}
+
+// Every pass: queued replies first, then the telemetry frame once the core has room for
+// all of it. Telemetry only ever waits for the next pass, and a frame still waiting
+// when the next one is made is dropped for it.
+void handle_tx()
+{
+  if (!Tx.drain() || TelemetryFrame[0] == '\0') {
+    return;
+  }
+  size_t length = strlen(TelemetryFrame);
+  if (Serial.availableForWrite() < (int)length) {
+    return;
+  }
+  Serial.write((const uint8_t *)TelemetryFrame, length);
+  TelemetryFrame[0] = '\0';
+}
+
 void handle_stepper_control()
 {
   // handle_zero_steppers();
@@ -223,7 +989,59 @@ void handle_data_input()
   // Serial.print(sfReader);
 
   if (sfReader == "info") {
-    Serial.println("main_module");
+    Tx.println("main_module");
+  }
+  // hello main_module <protocol> <build hash> <capabilities>, hash and capabilities in hex
+  else if (sfReader == "hello") {
+    Tx.print("hello main_module ");
+    Tx.print(ProtocolVersion);
+    Tx.print(" ");
+    Tx.print((unsigned long)FIRMWARE_HASH, HEX);
+    Tx.print(" ");
+    Tx.println(Capabilities, HEX);
+  }
+  else if (sfReader == "q") {
+    TelemetryForce = 1;
+  }
+  else if (sfReader == "o") {
+    report_overruns();
+  }
+
+  // Clock ping, k<n> is answered with clk <n> <millis> straight away
+  if (sfReader.startsWith("k")) {
+    Tx.print("clk ");
+    Tx.print(sfReader.c_str() + 1);
+    Tx.print(" ");
+    Tx.println(millis());
+  }
+
+  // Hold the next move until board time <ms>
+  if (sfReader.startsWith("@")) {
+    unsigned long at = strtoul(sfReader.c_str() + 1, NULL, 10);
+    if (at - millis() <= MaxScheduleAhead) {
+      ScheduledStart = at;
+      StartScheduled = 1;
+    }
+  }
+
+  // Jog velocity, j<pitch>,<yaw>,<zoom> each -1000..1000, ignored while a preset or target
+  // move runs, it would take over the move's speed
+  if (sfReader.startsWith("j") && SetpointStarted == 0) {
+    char *next;
+    long pitch = strtol(sfReader.c_str() + 1, &next, 10);
+    long yaw = (*next == ',') ? strtol(next + 1, &next, 10) : 0;
+    handle_jog(constrain(pitch, -1000, 1000), constrain(yaw, -1000, 1000));
+    JogRefreshed = millis();
+  }
+
+  // Jog deadman timeout, w<ms>
+  if (sfReader.startsWith("w")) {
+    long timeout;
+    sfReader.removeBefore(1);
+    if (sfReader.toLong(timeout) && timeout >= 0) {
+      JogTimeout = timeout;
+      JogRefreshed = millis();
+    }
   }
 
   // Pitch control
@@ -270,37 +1088,106 @@ void handle_data_input()
     StoredPitchPosD = iStepperPitchPos;
     StoredYawPosD = iStepperYawPos;
   } else if (sfReader == "t") {
-    SetpointStarted = 1;
-    iStepperPitchSpeed = 2000 * 1.5;
-    iStepperYawSpeed = 2000 * 1;
+    start_setpoint(1);
   } else if (sfReader == "t2") {
-    SetpointStarted = 2;
-    iStepperPitchSpeed = 2000 * 1.5;
-    iStepperYawSpeed = 2000 * 1;
+    start_setpoint(2);
   } else if (sfReader == "t3") {
-    SetpointStarted = 3;
-    iStepperPitchSpeed = 2000 * 1.5;
-    iStepperYawSpeed = 2000 * 1;
+    start_setpoint(3);
   } else if (sfReader == "t4") {
-    SetpointStarted = 4;
-    iStepperPitchSpeed = 2000 * 1.5;
-    iStepperYawSpeed = 2000 * 1;
+    start_setpoint(4);
+  }
+
+  // Soft limits, Lp<min>,<max> for pitch and Ly<min>,<max> for yaw
+  if (sfReader.startsWith("Lp") || sfReader.startsWith("Ly")) {
+    char *next;
+    long low = strtol(sfReader.c_str() + 2, &next, 10);
+    if (*next == ',') {
+      long high = strtol(next + 1, NULL, 10);
+      if (low <= high && sfReader.startsWith("Lp")) {
+        PitchLimitMin = constrain(low, -32768, 32767);
+        PitchLimitMax = constrain(high, -32768, 32767);
+      } else if (low <= high) {
+        YawLimitMin = constrain(low, -32768, 32767);
+        YawLimitMax = constrain(high, -32768, 32767);
+      }
+    }
+  }
+  // Backlash, Bp<steps> for pitch and By<steps> for yaw
+  if (sfReader.startsWith("Bp") || sfReader.startsWith("By")) {
+    char *next;
+    long steps = strtol(sfReader.c_str() + 2, &next, 10);
+    if (*next == '\0' && sfReader.startsWith("Bp")) {
+      PitchBacklash = constrain(steps, 0L, (long)MaxBacklash);
+    } else if (*next == '\0') {
+      YawBacklash = constrain(steps, 0L, (long)MaxBacklash);
+    }
+  }
+  // Encoders, Ep<steps per turn> for pitch and Ey<steps per turn> for yaw, 0 turns one off
+  if (sfReader.startsWith("Ep") || sfReader.startsWith("Ey")) {
+    char *next;
+    long stepsPerTurn = strtol(sfReader.c_str() + 2, &next, 10);
+    if (*next == '\0' && sfReader.startsWith("Ep")) {
+      encoder_setup(PitchEncoder, 'p', stepsPerTurn, iStepperPitchPos);
+    } else if (*next == '\0') {
+      encoder_setup(YawEncoder, 'y', stepsPerTurn, iStepperYawPos);
+    }
+  }
+  // Field of view scale, a running jog picks it up straight away
+  if (sfReader.startsWith("F")) {
+    long scale;
+    sfReader.removeBefore(1);
+    if (sfReader.toLong(scale)) {
+      FovScale = constrain(scale, FovScaleMin, 1000);
+      if (SetpointStarted == 0 && (JogPitch != 0 || JogYaw != 0)) {
+        handle_jog(JogPitch, JogYaw);
+      }
+    }
+  }
+  // Duration of the next move in ms
+  if (sfReader.startsWith("d")) {
+    long duration;
+    sfReader.removeBefore(1);
+    if (sfReader.toLong(duration) && duration >= 0) {
+      MoveDuration = duration;
+    }
+  }
+
+  // Absolute position
+  if (sfReader.startsWith("P")) {
+    int target;
+    sfReader.removeBefore(1);
+    if (sfReader.toInt(target)) {
+      start_direct_move(&TargetPitchPos, constrain(target, PitchLimitMin, PitchLimitMax));
+    }
+  }
+  else if (sfReader.startsWith("Y")) {
+    int target;
+    sfReader.removeBefore(1);
+    if (sfReader.toInt(target)) {
+      start_direct_move(&TargetYawPos, constrain(target, YawLimitMin, YawLimitMax));
+    }
   }
 
   // Speed control
   if (sfReader.startsWith("p")) {
     sfReader.removeBefore(1);
-    sfReader.toInt(iStepperPitchSpeed);
+    if (sfReader.toLong(iStepperPitchSpeed)) {
+      JogPitchSpeed = iStepperPitchSpeed;
+    }
   } 
   else if (sfReader.startsWith("y")) {
     sfReader.removeBefore(1);
-    sfReader.toInt(iStepperYawSpeed);
+    if (sfReader.toLong(iStepperYawSpeed)) {
+      JogYawSpeed = iStepperYawSpeed;
+    }
   } 
 }
 
-void loop()
+// Parser task: a few tokens per tick is still well ahead of the line rate
+const int InputBatch = 4;
+void handle_input()
 {
-  if (sfReader.read()) { // got a line or timed out  delimiter is NOT returned
+  for (int i = 0; i < InputBatch && sfReader.read(); i++) { // got a line or timed out  delimiter is NOT returned
     if (sfReader.hasError()) { // input length exceeded
       // Serial.println(F(" sfReader hasError. Read '\\0' or input overflowed."));
     }
@@ -314,6 +1201,87 @@ void loop()
     }
     // no need to clear sfReader as read() does that
   }
+  handle_credit();
+}
+
+// Cooperative scheduler. Stepping and the stop lane are polled on every pass of loop(),
+// everything else is a fixed-rate task: due every period, and counted as an overrun
+// when it starts more than its deadline late. One task runs per pass, the most overdue
+// one, so a step waits for at most one task. A task a whole period behind skips the
+// runs it missed rather than bursting to catch up.
+struct Task {
+  void (*run)();
+  unsigned long period; // us
+  unsigned long deadline; // us
+  unsigned long due;
+  unsigned int overruns;
+};
+Task Tasks[] = {
+  { handle_input, 1000, 1000, 0, 0 },
+  { handle_jog_deadman, JogStopTick * 1000, 2000, 0, 0 },
+  { handle_telemetry, TelemetryInterval * 1000, 5000, 0, 0 },
+  { handle_journal, JournalTick * 1000, JournalTick * 1000, 0, 0 },
+  { handle_encoders, EncoderTick * 1000, 2000, 0, 0 },
+};
+const int TaskCount = sizeof(Tasks) / sizeof(Tasks[0]);
+
+void start_tasks()
+{
+  unsigned long now = micros();
+  for (int i = 0; i < TaskCount; i++) {
+    Tasks[i].due = now;
+  }
+}
 
+void run_tasks()
+{
+  unsigned long now = micros();
+  Task *next = NULL;
+  for (int i = 0; i < TaskCount; i++) {
+    if ((long)(now - Tasks[i].due) >= 0 && (next == NULL || (long)(Tasks[i].due - next->due) < 0)) {
+      next = &Tasks[i];
+    }
+  }
+  if (next == NULL) {
+    return;
+  }
+  if (now - next->due > next->deadline) {
+    next->overruns++;
+  }
+  next->due += next->period;
+  if ((long)(now - next->due) >= 0) {
+    next->due = now + next->period;
+  }
+  next->run();
+}
+
+unsigned long WorstPass = 0; // us, longest pass of loop() since the last ovr
+
+// ovr <overruns of each task, in table order> <longest loop() pass in us>
+void report_overruns()
+{
+  Tx.print("ovr");
+  for (int i = 0; i < TaskCount; i++) {
+    Tx.print(" ");
+    Tx.print(Tasks[i].overruns);
+  }
+  Tx.print(" ");
+  Tx.println(WorstPass);
+  WorstPass = 0;
+}
+
+void loop()
+{
+  unsigned long start = micros();
+  if (SerialInput.poll()) {
+    emergency_stop();
+  }
+  journal_guard();
   handle_stepper_control();
+  run_tasks();
+  handle_tx();
+  unsigned long pass = micros() - start;
+  if (pass > WorstPass) {
+    WorstPass = pass;
+  }
 }
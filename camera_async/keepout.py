@@ -0,0 +1,117 @@
+"""Pan/tilt keep-out zones (projector screens, stage lights) and a planner that
+routes preset moves around them.
+
+A zone is [pitch_min, yaw_min, pitch_max, yaw_max] in motor steps. A preset
+recall whose path would cross a zone is run as a few straight timed legs
+through the zones' corners instead, picked as the fastest route at the boards'
+preset speeds. A zone that holds the start or the preset itself is ignored, the
+camera is meant to be there. Corners past the rig's soft limits are pulled back
+onto them, the boards would stop there anyway.
+"""
+import heapq
+import math
+
+ZONE_MARGIN = 20  # steps of clearance kept around a zone's corners
+# untimed preset moves step pitch every 2000 * 1.5 us and yaw every 2 * 2000 us
+PITCH_RATE = 1e6 / 3000  # steps/s
+YAW_RATE = 1e6 / 4000
+
+
+def leg_time(a, b):
+    """Seconds for a straight timed leg, as long as the slower axis needs"""
+    return max(abs(b[0] - a[0]) / PITCH_RATE, abs(b[1] - a[1]) / YAW_RATE)
+
+
+def preset_path(a, b):
+    """The path of an untimed preset move: both axes at their own rate until one
+    arrives, then the other one alone"""
+    dp, dy = b[0] - a[0], b[1] - a[1]
+    t = min(abs(dp) / PITCH_RATE, abs(dy) / YAW_RATE)
+    corner = (
+        a[0] + math.copysign(min(abs(dp), t * PITCH_RATE), dp),
+        a[1] + math.copysign(min(abs(dy), t * YAW_RATE), dy),
+    )
+    return [a, corner, b]
+
+
+def inside(p, zone):
+    return zone[0] < p[0] < zone[2] and zone[1] < p[1] < zone[3]
+
+
+def crosses(a, b, zone):
+    """Whether segment a-b passes through the inside of zone, running along an edge is fine"""
+    t0, t1 = 0.0, 1.0
+    for axis, low, high in ((0, zone[0], zone[2]), (1, zone[1], zone[3])):
+        d = b[axis] - a[axis]
+        if d == 0:
+            if not low < a[axis] < high:
+                return False
+            continue
+        ta, tb = (low - a[axis]) / d, (high - a[axis]) / d
+        t0, t1 = max(t0, min(ta, tb)), min(t1, max(ta, tb))
+        if t0 >= t1:
+            return False
+    mid = (t0 + t1) / 2
+    return inside((a[0] + (b[0] - a[0]) * mid, a[1] + (b[1] - a[1]) * mid), zone)
+
+
+def clear(a, b, zones):
+    return not any(crosses(a, b, zone) for zone in zones)
+
+
+def clip(p, bounds):
+    """p pulled inside bounds, [pitch_min, yaw_min, pitch_max, yaw_max] like a zone"""
+    if bounds is None:
+        return p
+    return (min(max(p[0], bounds[0]), bounds[2]), min(max(p[1], bounds[1]), bounds[3]))
+
+
+def plan(start, end, zones, bounds=None):
+    """Waypoints after start (the last one is end) for a move that has to go around
+    zones, or None when the plain preset move is clear. bounds are the soft limits
+    the waypoints have to stay within. Raises ValueError when the zones leave no way
+    through."""
+    zones = [z for z in zones if not inside(start, z) and not inside(end, z)]
+    path = preset_path(start, end)
+    if all(clear(a, b, zones) for a, b in zip(path, path[1:])):
+        return None
+
+    nodes = [start, end]
+    for z in zones:
+        for p in (
+            (z[0] - ZONE_MARGIN, z[1] - ZONE_MARGIN),
+            (z[0] - ZONE_MARGIN, z[3] + ZONE_MARGIN),
+            (z[2] + ZONE_MARGIN, z[1] - ZONE_MARGIN),
+            (z[2] + ZONE_MARGIN, z[3] + ZONE_MARGIN),
+        ):
+            p = clip(p, bounds)
+            if p not in nodes and not any(inside(p, other) for other in zones):
+                nodes.append(p)
+
+    # Dijkstra over the visibility graph, legs cost their travel time
+    best = {0: 0.0}
+    previous = {}
+    queue = [(0.0, 0)]
+    while queue:
+        cost, i = heapq.heappop(queue)
+        if i == 1:
+            break
+        if cost > best[i]:
+            continue
+        for j in range(1, len(nodes)):
+            if j == i or not clear(nodes[i], nodes[j], zones):
+                continue
+            c = cost + leg_time(nodes[i], nodes[j])
+            if c < best.get(j, math.inf):
+                best[j] = c
+                previous[j] = i
+                heapq.heappush(queue, (c, j))
+    if 1 not in previous:
+        raise ValueError("no route around the keep-out zones")
+
+    route = [end]
+    i = 1
+    while previous[i] != 0:
+        i = previous[i]
+        route.append(tuple(round(v) for v in nodes[i]))
+    return route[::-1]
@@ -0,0 +1,183 @@
+"""OSC (Open Sound Control) over UDP for show control tools like Companion, QLab
+or a lighting console, without going through the HTTP command server.
+
+Addresses (numeric arguments may be int or float), /camera/<rig>/... picks a
+rig by id, plain /camera/... goes to the default rig:
+    /camera/preset/recall <slot>
+    /camera/preset/store <slot>
+    /camera/preset/goto <slot> <seconds>   timed recall, every axis lands together
+    /camera/jog <pitch> <yaw> <zoom>       velocity, -1.0 .. 1.0 per axis
+    /camera/stop                           every axis at once, ahead of queued commands
+    /camera/cue/load <slot> [<seconds>]    arm the next cue
+    /camera/cue/go                         fire the armed cue
+
+Every message of a bundle is translated before anything is sent and the
+resulting tokens go out in one serial write per rig, so a bundle lands as one
+step (or not at all if any message in it is bad, cues loaded by it included).
+A stop is the exception, it is sent whatever else the bundle holds, and what the
+bundle had for that rig before it is dropped.
+Bundle time tags are ignored, bundles are applied on arrival.
+"""
+import socketserver
+import struct
+import time
+
+OSC_PREFIX = "/camera"
+OSC_JOG_MAX = 1000  # permille, see ARDUINO_JOG_MAX
+
+
+def parse_string(data, i):
+    end = data.index(b"\0", i)
+    return data[i:end].decode("ascii"), (end + 4) & ~3
+
+
+def parse_message(data):
+    address, i = parse_string(data, 0)
+    if i >= len(data):
+        return address, []
+    tags, i = parse_string(data, i)
+    if not tags.startswith(","):
+        raise ValueError("missing type tags")
+    args = []
+    for tag in tags[1:]:
+        if tag == "i":
+            args.append(struct.unpack_from(">i", data, i)[0])
+            i += 4
+        elif tag == "f":
+            args.append(struct.unpack_from(">f", data, i)[0])
+            i += 4
+        elif tag == "s":
+            s, i = parse_string(data, i)
+            args.append(s)
+        elif tag == "T":
+            args.append(True)
+        elif tag == "F":
+            args.append(False)
+        else:
+            raise ValueError("unsupported type tag %s" % tag)
+    return address, args
+
+
+def parse_packet(data):
+    """Flatten a message or (nested) bundle into a list of (address, args)"""
+    if not data.startswith(b"#bundle\0"):
+        return [parse_message(data)]
+    messages = []
+    i = 16  # "#bundle\0" and the 8 byte time tag
+    while i < len(data):
+        (size,) = struct.unpack_from(">i", data, i)
+        messages += parse_packet(data[i + 4 : i + 4 + size])
+        i += 4 + size
+    return messages
+
+
+def preset_cmd(prefix, slot):
+    slot = int(slot)
+    if slot < 1 or slot > 4:
+        raise ValueError("no preset %d" % slot)
+    return prefix if slot == 1 else "%s%d" % (prefix, slot)
+
+
+def jog_value(v):
+    return int(max(-1.0, min(1.0, float(v))) * OSC_JOG_MAX)
+
+
+class OscServer(socketserver.UDPServer):
+    """Single threaded on purpose, datagrams are applied in the order they arrive"""
+
+    allow_reuse_address = True
+
+    def __init__(self, address, find_rig, record_latency):
+        super().__init__(address, OscHandler)
+        self.find_rig = find_rig
+        self.record_latency = record_latency
+        self.cues = {}  # rig id -> (slot, seconds) armed by /camera/cue/load
+
+    def translate(self, address, args, cues):
+        """Map one OSC message onto its rig and firmware tokens, None for a stop.
+        Cue changes go into cues, the caller keeps them once the whole bundle translated."""
+        if not address.startswith(OSC_PREFIX + "/"):
+            raise ValueError("unknown address")
+        path = address[len(OSC_PREFIX) :]
+        rig_id = path.split("/")[1]
+        rig = self.find_rig(rig_id)
+        if rig is not None:
+            path = path[len(rig_id) + 1 :]
+        else:
+            rig = self.find_rig()
+            if rig is None:
+                raise ValueError("no rigs")
+        return rig, self.translate_path(rig.id, path, args, cues)
+
+    def translate_path(self, rig_id, path, args, cues):
+        if path == "/preset/recall" and len(args) >= 1:
+            return [preset_cmd("t", args[0])]
+        if path == "/preset/store" and len(args) >= 1:
+            return [preset_cmd("s", args[0])]
+        if path == "/preset/goto" and len(args) >= 2:
+            return ["d%d" % int(float(args[1]) * 1000), preset_cmd("t", args[0])]
+        if path == "/jog" and len(args) >= 3:
+            return ["j%d,%d,%d" % tuple(jog_value(v) for v in args[:3])]
+        if path == "/stop":
+            return None
+        if path == "/cue/load" and len(args) >= 1:
+            preset_cmd("t", args[0])  # validate now rather than on GO
+            cues[rig_id] = (int(args[0]), float(args[1]) if len(args) >= 2 else 0)
+            return []
+        if path == "/cue/go":
+            if rig_id not in cues:
+                raise ValueError("no cue loaded")
+            slot, seconds = cues.pop(rig_id)
+            if seconds > 0:
+                return ["d%d" % int(seconds * 1000), preset_cmd("t", slot)]
+            return [preset_cmd("t", slot)]
+        raise ValueError("unknown address or missing arguments")
+
+
+class OscHandler(socketserver.BaseRequestHandler):
+    def handle(self):
+        received = time.perf_counter()
+        data = self.request[0]
+        try:
+            messages = parse_packet(data)
+        except (ValueError, IndexError, struct.error, UnicodeDecodeError) as e:
+            print("bad osc packet from", self.client_address, e)
+            return
+
+        # all or nothing, one bad message drops the whole bundle, stops aside
+        rig_cmds = {}
+        stops = []
+        cues = dict(self.server.cues)
+        bad = False
+        for address, args in messages:
+            try:
+                rig, cmds = self.server.translate(address, args, cues)
+            except (TypeError, ValueError) as e:
+                print("osc", address, args, e)
+                bad = True
+                continue
+            if cmds is None:
+                if rig not in stops:
+                    stops.append(rig)
+                rig_cmds[rig] = []
+            else:
+                rig_cmds.setdefault(rig, []).extend(cmds)
+
+        for rig in stops:
+            error = rig.estop()
+            if error is not None:
+                print("osc", rig.id, "stop", error)
+                continue
+            self.server.record_latency("osc", received)
+        if bad:
+            return
+        self.server.cues = cues
+
+        for rig, cmds in rig_cmds.items():
+            if not cmds:
+                continue
+            error = rig.forward_cmds(cmds)
+            if error is not None:
+                print("osc", rig.id, cmds, error)
+                continue
+            self.server.record_latency("osc", received)
@@ -0,0 +1,132 @@
+"""Record a rig's commanded velocity and reported position at the control tick
+and replay it later as a streamed trajectory.
+
+A recording is an 8 byte header (b"CMRR", u16 version, u16 tick ms) followed
+by one 18 byte sample per tick, all little endian:
+    i16 pitch, i16 yaw, i16 zoom velocity (permille, as sent with j)
+    i32 pitch, i32 yaw, i32 zoom position (steps, as reported by the boards)
+
+Replay streams one timed move per tick (d<tick> P Y Z, only the axes that
+change), so every sample's position is reached at the end of its tick no
+matter how the host's timing wobbles. The rig first travels to the first
+sample at its normal speed, then the trajectory runs from there.
+"""
+import os
+import re
+import struct
+import threading
+import time
+
+RECORDING_MAGIC = b"CMRR"
+RECORDING_VERSION = 1
+RECORDING_HEADER = struct.Struct("<4sHH")
+RECORDING_SAMPLE = struct.Struct("<hhhiii")
+
+CONTROL_TICK_MS = 20  # same as the boards' TelemetryInterval
+REPLAY_MIN_TICK_MS = 5  # a tick scaled shorter than this outruns the serial link
+REPLAY_LEAD_IN_TIMEOUT = 30  # s to reach the first sample before giving up
+RECORDING_NAME = re.compile(r"^[A-Za-z0-9_-]{1,64}$")
+
+
+def recording_path(directory, name):
+    if not isinstance(name, str) or not RECORDING_NAME.match(name):
+        raise ValueError("invalid recording name")
+    return os.path.join(directory, name + ".cmrr")
+
+
+def load(path):
+    """Returns (tick ms, [(velocity, position), ...]) with velocity and position as (pitch, yaw, zoom)"""
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < RECORDING_HEADER.size:
+        raise ValueError("not a recording")
+    magic, version, tick_ms = RECORDING_HEADER.unpack_from(data)
+    if magic != RECORDING_MAGIC or version != RECORDING_VERSION or tick_ms == 0:
+        raise ValueError("not a recording")
+    samples = []
+    for offset in range(RECORDING_HEADER.size, len(data) - RECORDING_SAMPLE.size + 1, RECORDING_SAMPLE.size):
+        s = RECORDING_SAMPLE.unpack_from(data, offset)
+        samples.append((s[:3], s[3:]))
+    return tick_ms, samples
+
+
+class Recorder:
+    """Samples a rig every tick on an absolute schedule, so late wakeups never stretch the recording"""
+
+    def __init__(self, rig, path, tick_ms=CONTROL_TICK_MS):
+        self.rig = rig
+        self.path = path
+        self.tick_ms = tick_ms
+        self.stopped = threading.Event()
+        self.samples = 0
+        self.file = open(path, "wb")
+        self.file.write(RECORDING_HEADER.pack(RECORDING_MAGIC, RECORDING_VERSION, tick_ms))
+        threading.Thread(target=self.run, daemon=True).start()
+
+    def stop(self):
+        self.stopped.set()
+
+    def run(self):
+        start = time.monotonic()
+        tick = 0
+        while not self.stopped.wait(max(0, start + tick * self.tick_ms / 1000 - time.monotonic())):
+            tel = self.rig.telemetry_snapshot()
+            vel = self.rig.velocity
+            self.file.write(RECORDING_SAMPLE.pack(vel[0], vel[1], vel[2], tel["pitch"], tel["yaw"], tel["zoom"]))
+            self.samples += 1
+            tick += 1
+        self.file.close()
+        print("rig", self.rig.id, "recorded", self.samples, "samples to", self.path)
+
+
+class Replayer:
+    """Streams samples first..last of a recording with every tick stretched by scale"""
+
+    def __init__(self, rig, samples, tick_ms, scale=1.0, first=0, last=None, on_done=None):
+        self.rig = rig
+        self.samples = samples[first:last]
+        self.tick_ms = tick_ms * scale
+        if not self.samples:
+            raise ValueError("nothing to replay")
+        if self.tick_ms < REPLAY_MIN_TICK_MS:
+            raise ValueError("scale too small")
+        self.on_done = on_done  # (replayer, error or None)
+        self.stopped = threading.Event()
+        threading.Thread(target=self.run, daemon=True).start()
+
+    def stop(self):
+        self.stopped.set()
+
+    def lead_in(self, pos):
+        """Travel to the first sample at the boards' own speed"""
+        error = self.rig.forward_cmds(["j0,0,0", "d0", "P%d" % pos[0], "Y%d" % pos[1], "Z%d" % pos[2]])
+        if error is not None:
+            return error
+        deadline = time.monotonic() + REPLAY_LEAD_IN_TIMEOUT
+        while not self.stopped.wait(self.tick_ms / 1000):
+            tel = self.rig.telemetry_snapshot()
+            if (tel["pitch"], tel["yaw"], tel["zoom"]) == tuple(pos):
+                return None
+            if time.monotonic() > deadline:
+                return "did not reach the first sample"
+        return "stopped"
+
+    def run(self):
+        error = self.lead_in(self.samples[0][1])
+        last = self.samples[0][1]
+        start = time.monotonic()
+        duration = "d%d" % round(self.tick_ms)
+        for tick, (vel, pos) in enumerate(self.samples[1:], 1):
+            if error is not None:
+                break
+            if self.stopped.wait(max(0, start + (tick - 1) * self.tick_ms / 1000 - time.monotonic())):
+                error = "stopped"
+                break
+            cmds = ["%s%d" % (axis, p) for axis, p, q in zip("PYZ", pos, last) if p != q]
+            last = pos
+            if cmds:
+                error = self.rig.forward_cmds([duration] + cmds)
+        # a board that had no axis in the last tick still holds its d, it must not time the next move
+        self.rig.forward_cmds(["d0"])
+        if self.on_done is not None:
+            self.on_done(self, error)
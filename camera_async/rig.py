@@ -0,0 +1,978 @@
+"""One camera head: the main (pitch/yaw) and zoom board pair, their serial
+I/O and the telemetry they report. CameraController.py runs any number of
+these side by side, each with its own worker and reader threads.
+"""
+import threading
+import time
+from collections import deque
+import serial
+import keepout
+
+ARDUINO_BAUDRATE = 115200
+ARDUINO_RESET_WAIT = 10  # boards reset when the port opens
+ARDUINO_REOPEN_WAIT = 2  # retry interval while a board is unplugged
+
+ARDUINO_CMD_MAX_LEN = 24  # size of the firmware SafeStringReader token buffer
+
+ARDUINO_JOG_MAX = 1000  # j<pitch>,<yaw>,<zoom> velocities are permille of jog speed
+ARDUINO_SETPOINT_DIRECT = 5  # boards report absolute P/Y/Z moves as this setpoint
+ARDUINO_TARGET_CMDS = {"pitch": "P", "yaw": "Y", "zoom": "Z"}
+ARDUINO_LIMIT_CMDS = {"pitch": "Lp", "yaw": "Ly", "zoom": "Lz"}  # soft limits, L<axis><min>,<max>
+ARDUINO_ENCODER_CMDS = {"pitch": "Ep", "yaw": "Ey"}  # E<axis><steps per encoder turn>, main board only
+ARDUINO_ENCODER_AXES = {"p": "pitch", "y": "yaw"}  # axis letters in enc lines
+ARDUINO_BACKLASH_CMDS = {"pitch": "Bp", "yaw": "By"}  # B<axis><steps> of gear slack, main board only
+ARDUINO_PRESETS = (1, 2, 3, 4)  # s/t, s2/t2 ..., every preset is 0, 0 after a board reset
+
+# preset recalls through a keep-out zone run as routed legs, see keepout.py
+ROUTE_CACHE_SIZE = 256
+ROUTE_POLL = 0.02  # s, telemetry comes every 20 ms
+ROUTE_LEG_TIMEOUT = 1  # s a leg may overrun before the route is given up
+
+# k<n> pings are answered with clk <n> <millis>, which maps host time onto each board's clock
+ARDUINO_CLOCK_SYNC_INTERVAL = 2  # s between pings per board
+ARDUINO_CLOCK_SAMPLES = 16  # round trips kept per board, enough to follow the resonator drift
+ARDUINO_CLOCK_RTT_SLACK = 2  # ms, samples slower than the best round trip by more than this are ignored
+
+# hello is answered with hello <module> <protocol> <build hash> <capabilities>
+ARDUINO_PROTOCOL_VERSION = 1
+ARDUINO_MODULES = {"main": "main_module", "zoom": "zoom_module"}
+ARDUINO_CAP_TELEMETRY = 0x01  # pos/zpos lines
+ARDUINO_CAP_JOG = 0x02  # j velocity
+ARDUINO_CAP_TARGET = 0x04  # P/Y/Z absolute targets
+ARDUINO_CAP_TIMED_MOVE = 0x08  # d<ms>
+ARDUINO_CAP_CLOCK = 0x10  # k ping, @ scheduled start, timestamped mv lines
+ARDUINO_CAP_FOV_SCALE = 0x20  # F<permille>, main board only
+ARDUINO_CAP_SOFT_LIMITS = 0x40  # L<axis><min>,<max>
+ARDUINO_CAP_POSITION_JOURNAL = 0x80  # position restored from EEPROM after a reset at a clean stop
+ARDUINO_CAP_JOG_DEADMAN = 0x100  # w<ms>
+ARDUINO_CAP_STOP_LANE = 0x200  # ARDUINO_STOP_BYTE, answered with mv stop
+ARDUINO_CAP_CREDIT = 0x400  # cr <limit> flow control
+ARDUINO_CAP_TASK_STATS = 0x800  # o, answered with ovr <overruns per task>
+ARDUINO_CAP_ENCODER = 0x1000  # E<axis><steps per turn>, answered with enc lines
+ARDUINO_CAP_BACKLASH = 0x2000  # B<axis><steps>, taken up by the board when an axis turns round
+
+# The boards run everything but stepping as fixed-rate tasks and count each start that
+# missed its deadline, along with their longest loop() pass since the last read. The
+# counters are read every few clock sync rounds.
+ARDUINO_TASKS = ("input", "deadman", "telemetry", "journal", "encoder")  # firmware table order, zoom has no encoder
+ARDUINO_TASK_STATS_ROUNDS = 5
+
+# Written outside the token stream, ahead of anything still queued. The boards look for it
+# in the raw input before their token reader and stop every axis on the spot.
+ARDUINO_STOP_BYTE = b"\x18"
+
+# The boards report how far the host may write as cr <limit>: their count of bytes read
+# since the port opened (or since the last stop byte) plus what their input buffers
+# hold besides a stop byte, mod 2^16. Writes past the limit wait for the next report, so a board busy
+# stepping is never overrun and the host still writes at line rate otherwise.
+ARDUINO_CREDIT_TIMEOUT = 1  # s without new credit before the count is taken to be off
+
+# A jog the boards do not hear again within the timeout ramps to a stop (100 ms from
+# full speed), so a hung controller or a lost j0 cannot leave the head running.
+# A running jog is repeated every refresh interval, a few times per timeout.
+ARDUINO_JOG_TIMEOUT = 150  # ms
+ARDUINO_JOG_REFRESH = 0.04  # s
+
+# The main board scales pan/tilt speed by the field of view (F<permille of the wide end>),
+# relayed from the zoom position through a rig's calibrated "fov" table
+ARDUINO_FOV_SCALE_MIN = 50  # same floor as the firmware
+ARDUINO_FOV_SCALE_CHANGE = 0.02  # relay once the scale moved by this fraction, or hit an end
+
+
+def host_ms():
+    return time.monotonic() * 1000
+
+
+def check_cmds(cmds):
+    """Returns an error string for the first token the firmware could not take, or None"""
+    for cmd in cmds:
+        if not isinstance(cmd, str) or cmd == "":
+            return "missing cmd"
+        if len(cmd) > ARDUINO_CMD_MAX_LEN or not cmd.isascii() or not cmd.isprintable() or " " in cmd:
+            return "invalid cmd"
+    return None
+
+
+def jog_velocity(cmd):
+    """(pitch, yaw, zoom) of a j<pitch>,<yaw>,<zoom> token, None for anything else"""
+    if not cmd.startswith("j"):
+        return None
+    try:
+        fields = [int(v) for v in cmd[1:].split(",")]
+    except ValueError:
+        return None
+    fields = (fields + [0, 0, 0])[:3]
+    return tuple(max(-ARDUINO_JOG_MAX, min(ARDUINO_JOG_MAX, v)) for v in fields)
+
+
+def fov_scale(table, zoom):
+    """Field of view at a zoom position relative to the widest, in permille.
+    table is [[zoom steps, fov degrees], ...] sorted by steps, linear in between."""
+    widest = max(fov for _, fov in table)
+    if zoom <= table[0][0]:
+        fov = table[0][1]
+    elif zoom >= table[-1][0]:
+        fov = table[-1][1]
+    else:
+        for (z0, f0), (z1, f1) in zip(table, table[1:]):
+            if z0 <= zoom <= z1:
+                fov = f0 + (f1 - f0) * (zoom - z0) / (z1 - z0)
+                break
+    return max(ARDUINO_FOV_SCALE_MIN, min(1000, round(1000 * fov / widest)))
+
+
+def limit_cmds(limits):
+    """Soft limit tokens for a rig's {"pitch": [min, max], ...}, a KeyError or ValueError if malformed"""
+    cmds = []
+    for axis, (low, high) in (limits or {}).items():
+        if int(low) > int(high):
+            raise ValueError("%s limits are the wrong way round" % axis)
+        cmds.append(("%s%d,%d" % (ARDUINO_LIMIT_CMDS[axis], int(low), int(high))).encode("ascii"))
+    return cmds
+
+
+def encoder_cmds(encoders):
+    """Encoder tokens for a rig's {"pitch": steps per turn, ...}, a KeyError or ValueError if malformed"""
+    cmds = []
+    for axis, steps in (encoders or {}).items():
+        cmds.append(("%s%d" % (ARDUINO_ENCODER_CMDS[axis], int(steps))).encode("ascii"))
+    return cmds
+
+
+def backlash_cmds(backlash):
+    """Backlash tokens for a rig's {"pitch": steps, ...}, a KeyError or ValueError if malformed"""
+    cmds = []
+    for axis, steps in (backlash or {}).items():
+        if int(steps) < 0:
+            raise ValueError("%s backlash is negative" % axis)
+        cmds.append(("%s%d" % (ARDUINO_BACKLASH_CMDS[axis], int(steps))).encode("ascii"))
+    return cmds
+
+
+def preset_slot(cmd):
+    """Slot of a t/t2.. recall or s/s2.. store token, None for anything else"""
+    if cmd[:1] not in ("t", "s") or not (cmd[1:] == "" or cmd[1:].isdigit()):
+        return None
+    slot = int(cmd[1:] or 1)
+    return slot if slot in ARDUINO_PRESETS else None
+
+
+def move_boards(cmds):
+    """The boards that start a move from these tokens, d/j and the rest start nothing"""
+    boards = set()
+    for cmd in cmds:
+        if cmd[:1] == "t":
+            boards |= {"main", "zoom"}
+        elif cmd[:1] in ("P", "Y"):
+            boards.add("main")
+        elif cmd[:1] == "Z":
+            boards.add("zoom")
+    return boards
+
+
+class BoardClock:
+    """Offset and drift of one board's millis() against host_ms(), fitted over recent round trips"""
+
+    def __init__(self):
+        self.samples = deque(maxlen=ARDUINO_CLOCK_SAMPLES)  # (host ms, offset ms, round trip ms)
+
+    def add(self, sent, received, board_ms):
+        rtt = received - sent
+        self.samples.append((sent + rtt / 2, board_ms - (sent + rtt / 2), rtt))
+
+    def synced(self):
+        return len(self.samples) > 0
+
+    def fit(self):
+        """Offset at the newest good sample and drift in ms per host ms"""
+        samples = list(self.samples)  # the reader thread keeps appending
+        best = min(s[2] for s in samples)
+        good = [s for s in samples if s[2] <= best + ARDUINO_CLOCK_RTT_SLACK]
+        t0, o0, _ = good[-1]
+        if len(good) < 2:
+            return t0, o0, 0.0
+        mean_t = sum(s[0] for s in good) / len(good)
+        mean_o = sum(s[1] for s in good) / len(good)
+        var = sum((s[0] - mean_t) ** 2 for s in good)
+        drift = sum((s[0] - mean_t) * (s[1] - mean_o) for s in good) / var if var > 0 else 0.0
+        return t0, mean_o + drift * (t0 - mean_t), drift
+
+    def to_board(self, host):
+        t0, o0, drift = self.fit()
+        return int(round(host + o0 + drift * (host - t0))) & 0xFFFFFFFF
+
+    def to_host(self, board_ms, near):
+        """Host time of a board timestamp, near is a host time within a few weeks of it"""
+        diff = (board_ms - self.to_board(near)) & 0xFFFFFFFF
+        if diff >= 0x80000000:
+            diff -= 0x100000000
+        return near + diff
+
+    def drift_ppm(self):
+        return self.fit()[2] * 1e6 if self.synced() else 0.0
+
+
+class CreditPort:
+    """A board's serial port whose writes stay within the credit the board reported.
+    Anything else is passed through to the serial.Serial underneath."""
+
+    def __init__(self, port):
+        self.port = port
+        self.cond = threading.Condition()
+        self.sent = 0  # bytes written, mod 2^16 like the board's count
+        self.limit = None  # unchecked until the board reports credit, older firmware never does
+        self.resync = False  # stop byte written, credit counts again from the board's mv stop
+        self.stops = 0
+
+    def __getattr__(self, name):
+        return getattr(self.port, name)
+
+    def credit(self, limit):
+        with self.cond:
+            if not self.resync:
+                self.limit = limit
+                self.cond.notify_all()
+
+    def resynced(self):
+        with self.cond:
+            self.resync = False
+
+    def write(self, data):
+        with self.cond:
+            stops = self.stops
+            while data:
+                if self.limit is None:
+                    n = len(data)
+                else:
+                    n = (self.limit - self.sent) & 0xFFFF
+                    n = min(len(data), n if n < 0x8000 else 0)
+                if n == 0:
+                    if not self.cond.wait(ARDUINO_CREDIT_TIMEOUT):
+                        print("no credit from", self.port.port, "in", ARDUINO_CREDIT_TIMEOUT, "s, writing unchecked")
+                        self.limit = None
+                    if not self.port.is_open:
+                        raise serial.SerialException("port closed")
+                    if self.stops != stops:
+                        return  # the rest was queued behind the stop, the board dropped the start of it
+                    continue
+                self.port.write(data[:n])
+                self.sent = (self.sent + n) & 0xFFFF
+                data = data[n:]
+
+    def write_stop(self, byte):
+        """Drop what the OS still holds for the board and write byte, which also restarts
+        the board's count"""
+        with self.cond:
+            self.port.reset_output_buffer()
+            self.port.write(byte)
+            self.port.flush()
+            self.stops += 1
+            self.sent = 0
+            if self.limit is not None:
+                self.limit = 0
+                self.resync = True
+            self.cond.notify_all()
+
+    def write_after_stop(self, data):
+        """Write a few bytes right behind a stop byte without waiting for the board's mv stop,
+        its input was just emptied and has room for them"""
+        with self.cond:
+            self.port.write(data)
+            self.sent = (self.sent + len(data)) & 0xFFFF
+
+    def close(self):
+        self.port.close()
+        with self.cond:
+            self.cond.notify_all()
+
+
+class Rig:
+    def __init__(
+        self,
+        rig_id,
+        port,
+        zoom_port,
+        broadcast,
+        init_cmds,
+        on_move_edge=None,
+        baudrate=ARDUINO_BAUDRATE,
+        fov=None,
+        limits=None,
+        keep_out=None,
+        encoders=None,
+        backlash=None,
+    ):
+        self.id = rig_id
+        self.port = port
+        self.zoom_port = zoom_port
+        self.baudrate = baudrate
+        self.broadcast = broadcast  # pushes a message to every command client
+        # sent once the boards are up, before anything else
+        self.init_cmds = init_cmds + limit_cmds(limits) + encoder_cmds(encoders) + backlash_cmds(backlash)
+        # [[zoom steps, fov degrees], ...] measured on the lens, no speed scaling without it
+        self.fov = sorted((int(z), float(f)) for z, f in fov) if fov else None
+        self.fov_sent = None  # last F relayed to the main board
+        # the zoom reader picks the F to relay, fov_relay writes it: a reader waiting for
+        # serial_lock could hold up the credit a writer under the lock is waiting for
+        self.fov_wanted = None
+        self.fov_pending = threading.Event()
+
+        # [[pitch_min, yaw_min, pitch_max, yaw_max], ...] pan/tilt never passes through on a preset recall
+        self.keep_out = [[int(v) for v in zone] for zone in keep_out or []]
+        # soft limits as [pitch_min, yaw_min, pitch_max, yaw_max], routes stay within them
+        pitch, yaw = (limits or {}).get("pitch", (-32768, 32767)), (limits or {}).get("yaw", (-32768, 32767))
+        self.bounds = [int(pitch[0]), int(yaw[0]), int(pitch[1]), int(yaw[1])]
+        if any(len(zone) != 4 or zone[0] >= zone[2] or zone[1] >= zone[3] for zone in self.keep_out):
+            raise ValueError("keep_out zones are [pitch_min, yaw_min, pitch_max, yaw_max]")
+        self.presets = {slot: (0, 0) for slot in ARDUINO_PRESETS}  # pitch, yaw the boards hold per preset
+        self.routes = {}  # (from, to) -> waypoints or None, planned once per pair
+        self.routes_lock = threading.Lock()
+        self.route_gen = 0  # bumped by every other command, a running route stops at its next leg
+
+        self.arduino = None
+        self.arduino_zoom = None
+        self.online = False
+        self.stopped = False
+        self.lost = threading.Event()
+
+        # gamepad loop and remote commands both write, keep tokens from interleaving
+        self.serial_lock = threading.Lock()
+
+        # last position reported by the boards, move is the preset being travelled to (0 when idle)
+        self.telemetry = {"pitch": 0, "yaw": 0, "zoom": 0, "move": 0}
+        self.board_setpoint = {"main": 0, "zoom": 0}
+        self.move_id = 0  # bumped on every preset move so clients can wait for their own arrival
+        self.telemetry_lock = threading.Lock()
+
+        self.clock = {"main": BoardClock(), "zoom": BoardClock()}
+        self.pings = {}  # ping number -> (board, host ms sent)
+        self.ping_seq = 0
+        self.on_move_edge = on_move_edge  # (rig, board, "start" | "done", host ms) for every timestamped mv line
+
+        # board -> {"module", "protocol", "build", "caps"} from its hello, missing until it answered
+        self.boards = {}
+        self.encoders = {}  # axis -> "on" | "off" | "fault" as the main board last reported
+
+        self.velocity = (0, 0, 0)  # last jog sent, whoever sent it
+        self.stopping = set()  # boards sent the stop byte that have not answered mv stop yet
+        self.recorder = None
+        self.replayer = None
+
+    def start(self):
+        threading.Thread(target=self.run, daemon=True).start()
+
+    def stop(self):
+        self.stopped = True
+        self.lost.set()
+        if self.recorder is not None:
+            self.recorder.stop()
+        if self.replayer is not None:
+            self.replayer.stop()
+
+    def run(self):
+        """Open the boards, keep them open and reopen them if they go away"""
+        waiting = False
+        while not self.stopped:
+            arduino = None
+            try:
+                arduino = CreditPort(serial.Serial(self.port, self.baudrate))
+                arduino_zoom = CreditPort(serial.Serial(self.zoom_port, self.baudrate))
+            except serial.SerialException as e:
+                if arduino is not None:
+                    arduino.close()
+                if not waiting:
+                    print("rig", self.id, "waiting for boards:", e)
+                    waiting = True
+                time.sleep(ARDUINO_REOPEN_WAIT)
+                continue
+            waiting = False
+
+            print("rig", self.id, "waiting for serial connection...")
+            time.sleep(ARDUINO_RESET_WAIT)
+            if self.stopped:
+                arduino.close()
+                arduino_zoom.close()
+                return
+            self.lost.clear()
+            with self.serial_lock:
+                self.arduino = arduino
+                self.arduino_zoom = arduino_zoom
+                # the boards restarted their millis() when the port opened
+                self.clock = {"main": BoardClock(), "zoom": BoardClock()}
+                self.pings = {}
+                self.boards = {}
+                self.encoders = {}
+                self.fov_sent = None
+                self.fov_wanted = None
+                self.fov_pending = threading.Event()
+                # the boards reset with the port, a route is planned to 0, 0 until a preset is stored again
+                self.presets = {slot: (0, 0) for slot in ARDUINO_PRESETS}
+                self.route_gen += 1
+                self.velocity = (0, 0, 0)
+                self.stopping = set()
+            for cmd in self.init_cmds:
+                self.send_cmd(cmd)
+                time.sleep(0.1)
+            threading.Thread(target=self.serial_reader, args=(arduino, "main"), daemon=True).start()
+            threading.Thread(target=self.serial_reader, args=(arduino_zoom, "zoom"), daemon=True).start()
+            threading.Thread(target=self.clock_sync, daemon=True).start()
+            threading.Thread(target=self.jog_heartbeat, daemon=True).start()
+            threading.Thread(target=self.fov_relay, daemon=True).start()
+            self.send_cmd(b"hello")  # which build each board runs and what it can do
+            self.send_cmd(b"w%d" % ARDUINO_JOG_TIMEOUT)
+            self.send_cmd(b"q")  # report current position
+            self.set_online(True)
+
+            self.lost.wait()
+            self.fov_pending.set()  # lets fov_relay see the rig is lost
+            with self.serial_lock:
+                self.arduino = None
+                self.arduino_zoom = None
+            arduino.close()
+            arduino_zoom.close()
+            self.set_online(False)
+
+    def set_online(self, online):
+        self.online = online
+        print("rig", self.id, "online" if online else "offline")
+        self.broadcast({"rig": self.id, "online": online})
+
+    def note_cmds(self, cmds):
+        """Follow what the boards were told: the jog velocity and the presets stored"""
+        self.route_gen += 1
+        for cmd in cmds:
+            vel = jog_velocity(cmd)
+            if vel is not None:
+                self.velocity = vel
+            elif move_boards([cmd]):
+                self.velocity = (0, 0, 0)  # the heartbeat must not jog on through the move
+            slot = preset_slot(cmd)
+            if slot is not None and cmd[0] == "s":
+                tel = self.telemetry_snapshot()
+                self.presets[slot] = (tel["pitch"], tel["yaw"])
+                if self.keep_out:
+                    threading.Thread(target=self.plan_preset_routes, daemon=True).start()
+
+    def send_cmd(self, cmd):
+        if self.keep_out and preset_slot(cmd.decode("ascii", "replace")) is not None:
+            try:
+                route = self.plan_move([cmd.decode("ascii")])
+            except ValueError as e:
+                print("rig", self.id, e)
+                return
+            if route is not None:
+                self.run_route(*route)
+                return
+        with self.serial_lock:
+            if self.arduino is None:
+                return
+            self.note_cmds([cmd.decode("ascii", "replace")])
+            try:
+                self.arduino.write(cmd + b" ")
+                self.arduino_zoom.write(cmd + b" ")
+            except serial.SerialException:
+                self.lost.set()
+
+    def tell_cmd(self, msg):
+        x = msg.encode("ascii")  # encode n send
+        with self.serial_lock:
+            if self.arduino is None:
+                return
+            try:
+                self.arduino.write(x)
+                self.arduino_zoom.write(x)
+            except serial.SerialException:
+                self.lost.set()
+
+    def forward_cmds(self, cmds):
+        """Send remote commands to both boards in a single write, returns an error string or None once written out"""
+        error = check_cmds(cmds)
+        if error is not None:
+            return error
+        try:
+            route = self.plan_move(cmds)
+        except ValueError as e:
+            return str(e)
+        if route is not None:
+            return self.run_route(*route)
+        data = "".join(cmd + " " for cmd in cmds).encode("ascii")
+        with self.serial_lock:
+            if self.arduino is None:
+                return "rig offline"
+            self.note_cmds(cmds)
+            try:
+                self.arduino.write(data)
+                self.arduino_zoom.write(data)
+                self.arduino.flush()
+                self.arduino_zoom.flush()
+            except serial.SerialException as e:
+                self.lost.set()
+                return str(e)
+        return None
+
+    def forward_cmd(self, cmd):
+        return self.forward_cmds([cmd])
+
+    def estop(self):
+        """Stop every axis now. The stop byte does not wait for serial_lock, the OS drops
+        whatever it still holds for the boards and the boards drop what they had not read."""
+        self.velocity = (0, 0, 0)  # before the heartbeat can repeat the jog
+        self.route_gen += 1
+        if self.replayer is not None:
+            self.replayer.stop()
+        arduino, arduino_zoom = self.arduino, self.arduino_zoom
+        if arduino is None:
+            return "rig offline"
+        with self.telemetry_lock:
+            self.stopping = {board for board in ("main", "zoom") if self.has_cap(board, ARDUINO_CAP_STOP_LANE)}
+        try:
+            for port in (arduino, arduino_zoom):
+                port.write_stop(ARDUINO_STOP_BYTE)
+        except serial.SerialException as e:
+            self.lost.set()
+            return str(e)
+        # a jog written by another thread after the stop byte is taken back, the leading
+        # space ends whatever part of a token the flush left behind. It does not wait for
+        # credit, that would hold serial_lock until the boards answer the stop.
+        with self.serial_lock:
+            self.velocity = (0, 0, 0)
+            try:
+                arduino.write_after_stop(b" j0,0,0 ")
+                arduino_zoom.write_after_stop(b" j0,0,0 ")
+            except serial.SerialException:
+                self.lost.set()
+        return None
+
+    def stop_move(self, board):
+        """A board answered the stop byte, whatever preset move was under way ends here"""
+        self.stopping.discard(board)
+        self.board_setpoint[board] = 0
+        self.board_setpoint.pop("route", None)
+        current = self.telemetry["move"]
+        if current != 0:
+            self.telemetry["move"] = 0
+            self.broadcast({"rig": self.id, "evt": {"type": "stopped", "id": self.move_id, "slot": current}})
+
+    def route(self, start, end):
+        """Waypoints from start to end around the keep-out zones, None for a plain move. Cached per pair."""
+        key = (start, end)
+        with self.routes_lock:
+            if key in self.routes:
+                return self.routes[key]
+        route = keepout.plan(start, end, self.keep_out, self.bounds)
+        with self.routes_lock:
+            if len(self.routes) >= ROUTE_CACHE_SIZE:
+                self.routes.clear()
+            self.routes[key] = route
+        return route
+
+    def plan_preset_routes(self):
+        """Plan every preset to preset move ahead, so recalling one never waits for the planner"""
+        presets = list(self.presets.values())
+        for start in presets:
+            for end in presets:
+                if start != end:
+                    try:
+                        self.route(start, end)
+                    except ValueError:
+                        pass
+
+    def plan_move(self, cmds):
+        """(waypoints, cmds, duration, slot) when cmds take pan/tilt across a keep-out zone, else None.
+        The route carries cmds without their d, slot is the preset recalled or None for an absolute target.
+        Raises ValueError when there is no way around, or when cmds hold more than one move and the d,
+        zero pan/tilt jogs and zoom targets a route can take along."""
+        if not self.keep_out:
+            return None
+        tel = self.telemetry_snapshot()
+        start = (tel["pitch"], tel["yaw"])
+        presets = dict(self.presets)
+        end = None
+        durations, recalls, targets, rest = [], [], [], []
+        for cmd in cmds:
+            slot = preset_slot(cmd)
+            vel = jog_velocity(cmd)
+            if cmd[:1] == "d" and cmd[1:].isdigit():
+                durations.append(int(cmd[1:]))
+                continue
+            if slot is not None and cmd[0] == "t":
+                recalls.append(slot)
+                end = presets[slot]
+            elif cmd[:1] in ("P", "Y") and cmd[1:].lstrip("-").isdigit():
+                targets.append(cmd)
+                pitch, yaw = end or start
+                end = (int(cmd[1:]), yaw) if cmd[0] == "P" else (pitch, int(cmd[1:]))
+            elif slot is not None:
+                presets[slot] = start
+                rest.append(cmd)
+            elif cmd[:1] != "Z" and (vel is None or vel[:2] != (0, 0)):
+                rest.append(cmd)
+        if end is None:
+            return None
+        waypoints = self.route(start, end)
+        if waypoints is None:
+            return None
+        if rest or len(durations) > 1 or len(recalls) + bool(targets) > 1:
+            raise ValueError("a move around a keep_out zone has to be sent on its own")
+        cmds = [cmd for cmd in cmds if not (cmd[:1] == "d" and cmd[1:].isdigit())]
+        return waypoints, cmds, durations[0] if durations else 0, recalls[0] if recalls else None
+
+    def run_route(self, waypoints, cmds, duration, slot):
+        """Start a routed move, returns an error string or None once it is under way"""
+        if self.arduino is None:
+            return "rig offline"
+        tel = self.telemetry_snapshot()
+        legs = []
+        at = (tel["pitch"], tel["yaw"])
+        # timed legs ignore the fov scale, run them at the speed the preset move would have had
+        scale = 1000 / (self.fov_sent or 1000)
+        for point in waypoints:
+            legs.append(keepout.leg_time(at, point) * 1000 * scale)
+            at = point
+        total = sum(legs)
+        if duration > total:
+            legs = [leg * duration / total for leg in legs]
+            total = duration
+        legs = [max(1, round(leg)) for leg in legs]
+        with self.serial_lock:
+            self.route_gen += 1
+            gen = self.route_gen
+            self.velocity = (0, 0, 0)
+        if slot is not None:
+            with self.telemetry_lock:
+                # arrival waits for the last leg, not for the zoom or the first corner
+                self.update_move("route", slot)
+        zoom_duration = total if duration else 0  # a timed move lands the zoom with pan/tilt
+        args = (gen, waypoints, legs, cmds, slot, zoom_duration)
+        threading.Thread(target=self.route_runner, args=args, daemon=True).start()
+        return None
+
+    def write_board(self, board, cmds, gen):
+        """Write to one board unless the route was overtaken, False once it should stop"""
+        with self.serial_lock:
+            port = self.board_port(board)
+            if port is None or gen != self.route_gen:
+                return False
+            try:
+                port.write("".join(cmd + " " for cmd in cmds).encode("ascii"))
+                port.flush()
+            except serial.SerialException:
+                self.lost.set()
+                return False
+        return True
+
+    def route_runner(self, gen, waypoints, legs, cmds, slot, zoom_duration):
+        """Drive pan/tilt corner to corner, the last leg is the move itself so its events are the usual ones"""
+        ok = self.write_board("zoom", ["d%d" % zoom_duration] + cmds, gen)
+        for point, leg in zip(waypoints[:-1], legs):
+            if not ok or not self.write_board("main", ["d%d" % leg, "P%d" % point[0], "Y%d" % point[1]], gen):
+                ok = False
+                break
+            deadline = time.monotonic() + leg / 1000 * 2 + ROUTE_LEG_TIMEOUT
+            while gen == self.route_gen:
+                tel = self.telemetry_snapshot()
+                if (tel["pitch"], tel["yaw"]) == point:
+                    break
+                if time.monotonic() > deadline:
+                    print("rig", self.id, "route to", waypoints[-1], "did not reach", point)
+                    ok = False
+                    break
+                time.sleep(ROUTE_POLL)
+        if slot is None:
+            if ok:
+                self.write_board("main", ["d%d" % legs[-1]] + cmds, gen)
+            return
+        if ok and self.write_board("main", ["d%d" % legs[-1]] + cmds, gen):
+            # hold on until the main board took the recall over
+            deadline = time.monotonic() + ROUTE_LEG_TIMEOUT
+            while gen == self.route_gen and self.board_setpoint["main"] != slot and time.monotonic() < deadline:
+                time.sleep(ROUTE_POLL)
+        with self.telemetry_lock:
+            self.update_move("route", 0)
+
+    def has_cap(self, board, cap):
+        """Whether a board can do cap, a board that has not said hello yet is given the benefit of the doubt"""
+        info = self.boards.get(board)
+        return info is None or bool(info["caps"] & cap)
+
+    def handle_hello(self, board, fields):
+        try:
+            info = {
+                "module": fields[1],
+                "protocol": int(fields[2]),
+                "build": "%08x" % int(fields[3], 16),
+                "caps": int(fields[4], 16),
+            }
+        except ValueError:
+            return
+        self.boards[board] = info
+        print(
+            "rig %s %s board: %s protocol %d build %s caps %02x"
+            % (self.id, board, info["module"], info["protocol"], info["build"], info["caps"])
+        )
+        if info["module"] != ARDUINO_MODULES[board]:
+            print("rig", self.id, board, "port has the", info["module"], "board, are port and zoom_port swapped?")
+        if info["protocol"] != ARDUINO_PROTOCOL_VERSION:
+            print("rig", self.id, board, "board speaks protocol", info["protocol"], "reflash it")
+        self.broadcast({"rig": self.id, "boards": dict(self.boards)})
+
+    def handle_overruns(self, board, counts, worst_pass):
+        """Log the board's tasks that missed deadlines since the last read, the totals and
+        the longest loop() pass go out with its hello"""
+        info = self.boards.get(board)
+        if info is None:
+            return
+        overruns = dict(zip(ARDUINO_TASKS, counts))
+        before = info.get("overruns", {})
+        late = ["%s +%d" % (task, n - before.get(task, 0)) for task, n in overruns.items() if n > before.get(task, 0)]
+        if late:
+            print("rig", self.id, board, "board task overruns:", ", ".join(late), "longest pass", worst_pass, "us")
+        info["overruns"] = overruns
+        info["worst_pass_us"] = worst_pass
+        self.broadcast({"rig": self.id, "boards": dict(self.boards)})
+
+    def handle_encoder(self, board, fields):
+        """enc on|off|fault|fix|stall <axis> <step count> <encoder position>. A fix is the board taking
+        the encoder's position for a still axis, a stall stopped every axis and is followed by mv stop."""
+        event, axis, steps, measured = fields[1], ARDUINO_ENCODER_AXES.get(fields[2]), int(fields[3]), int(fields[4])
+        if axis is None:
+            return
+        if event in ("fix", "stall"):
+            print("rig", self.id, axis, "encoder", event, "at", steps, "steps, encoder has", measured)
+        if event == "stall":
+            evt = {"type": "stall", "axis": axis, "steps": steps, "encoder": measured}
+            self.broadcast({"rig": self.id, "evt": evt})
+        elif event in ("on", "off", "fault"):
+            if event == "fault":
+                print("rig", self.id, axis, "encoder not answering, running open loop")
+            self.encoders[axis] = event
+            self.broadcast({"rig": self.id, "encoders": dict(self.encoders)})
+
+    def relay_fov(self, zoom):
+        """Have the field of view at this zoom position passed on to the main board when it changed enough.
+        Runs on the zoom reader, the write is left to fov_relay."""
+        if self.fov is None or not self.has_cap("main", ARDUINO_CAP_FOV_SCALE):
+            return
+        scale = fov_scale(self.fov, zoom)
+        sent = self.fov_wanted
+        if scale == sent:
+            return
+        # small steps wait until they add up, the ends are always relayed exactly
+        ends = (1000, ARDUINO_FOV_SCALE_MIN)
+        if sent is not None and abs(scale - sent) < sent * ARDUINO_FOV_SCALE_CHANGE and scale not in ends:
+            return
+        self.fov_wanted = scale
+        self.fov_pending.set()
+
+    def fov_relay(self):
+        """Write the field of view relay_fov asked for, only the newest if several came in"""
+        lost, pending = self.lost, self.fov_pending
+        while True:
+            pending.wait()
+            pending.clear()
+            if lost.is_set():
+                return
+            scale = self.fov_wanted
+            with self.serial_lock:
+                if self.arduino is None:
+                    return
+                if scale == self.fov_sent:
+                    continue
+                try:
+                    self.arduino.write(b"F%d " % scale)
+                    self.arduino.flush()
+                except serial.SerialException:
+                    self.lost.set()
+                    return
+                self.fov_sent = scale
+
+    def board_port(self, board):
+        return self.arduino if board == "main" else self.arduino_zoom
+
+    def schedule_cmds(self, cmds, at):
+        """Send commands that start a move at host time at, each board gets it in its own clock.
+        Boards that take no part in the move are left alone."""
+        error = check_cmds(cmds)
+        if error is not None:
+            return error
+        boards = move_boards(cmds)
+        if not boards:
+            return "no move to schedule"
+        try:
+            if self.plan_move(cmds) is not None:
+                return "a sync move cannot be routed around keep_out zones"
+        except ValueError as e:
+            return str(e)
+        for board in boards:
+            if not self.has_cap(board, ARDUINO_CAP_CLOCK):
+                return "%s board firmware cannot schedule moves" % board
+            if not self.clock[board].synced():
+                return "clock not synced"
+        with self.serial_lock:
+            if self.arduino is None:
+                return "rig offline"
+            self.note_cmds(cmds)
+            try:
+                for board in boards:
+                    at_board = self.clock[board].to_board(at)
+                    self.board_port(board).write(("@%d " % at_board + "".join(cmd + " " for cmd in cmds)).encode("ascii"))
+                for board in boards:
+                    self.board_port(board).flush()
+            except serial.SerialException as e:
+                self.lost.set()
+                return str(e)
+        return None
+
+    def clock_sync(self):
+        """Ping each board on its own so clk replies measure one board's round trip"""
+        lost = self.lost
+        burst = 4  # a few quick rounds so a fresh connection is usable straight away
+        rounds = 0
+        while not lost.is_set():
+            rounds += 1
+            for board in ("main", "zoom"):
+                if not self.has_cap(board, ARDUINO_CAP_CLOCK):
+                    continue
+                stats = rounds % ARDUINO_TASK_STATS_ROUNDS == 0 and self.has_cap(board, ARDUINO_CAP_TASK_STATS)
+                with self.serial_lock:
+                    port = self.board_port(board)
+                    if port is None:
+                        return
+                    self.ping_seq += 1
+                    self.pings[self.ping_seq] = (board, host_ms())
+                    try:
+                        port.write(b"k%d " % self.ping_seq + (b"o " if stats else b""))
+                        port.flush()
+                    except serial.SerialException:
+                        lost.set()
+                        return
+            burst -= 1
+            lost.wait(0.1 if burst > 0 else ARDUINO_CLOCK_SYNC_INTERVAL)
+
+    def jog_heartbeat(self):
+        """Repeat a running jog so the boards' deadman only fires when the controller stops"""
+        lost = self.lost
+        while not lost.wait(ARDUINO_JOG_REFRESH):
+            with self.serial_lock:
+                if self.arduino is None:
+                    return
+                if self.velocity == (0, 0, 0):
+                    continue
+                try:
+                    data = b"j%d,%d,%d " % self.velocity
+                    self.arduino.write(data)
+                    self.arduino_zoom.write(data)
+                except serial.SerialException:
+                    lost.set()
+                    return
+
+    def send_velocity(self, vel):
+        """Jog all axes at a signed permille velocity, vel is {"pitch": p, "yaw": y, "zoom": z}"""
+        try:
+            pitch, yaw, zoom = (
+                max(-ARDUINO_JOG_MAX, min(ARDUINO_JOG_MAX, int(vel.get(axis, 0))))
+                for axis in ("pitch", "yaw", "zoom")
+            )
+        except (AttributeError, TypeError, ValueError):
+            return "invalid vel"
+        return self.forward_cmd("j%d,%d,%d" % (pitch, yaw, zoom))
+
+    def send_target(self, target):
+        """Move the given axes to absolute step positions, target is {"yaw": n, ...}"""
+        if not isinstance(target, dict) or not target:
+            return "invalid target"
+        cmds = []
+        for axis, pos in target.items():
+            if axis not in ARDUINO_TARGET_CMDS:
+                return "invalid target"
+            try:
+                cmds.append("%s%d" % (ARDUINO_TARGET_CMDS[axis], int(pos)))
+            except (TypeError, ValueError):
+                return "invalid target"
+        return self.forward_cmds(cmds)
+
+    def telemetry_snapshot(self):
+        with self.telemetry_lock:
+            return dict(self.telemetry)
+
+    def update_move(self, board, slot):
+        """Track the preset move across both boards, a move has arrived once every board is idle"""
+        if slot == ARDUINO_SETPOINT_DIRECT or board in self.stopping:
+            slot = 0  # not a preset, or telemetry sent before the board saw the stop
+        self.board_setpoint[board] = slot
+        current = self.telemetry["move"]
+        if slot != 0 and slot != current:
+            self.move_id += 1
+            self.telemetry["move"] = slot
+            self.broadcast({"rig": self.id, "evt": {"type": "move", "id": self.move_id, "slot": slot}})
+        elif current != 0 and not any(self.board_setpoint.values()):
+            self.telemetry["move"] = 0
+            self.broadcast({"rig": self.id, "evt": {"type": "arrived", "id": self.move_id, "slot": current}})
+
+    def handle_board_line(self, line, board):
+        fields = line.split()
+        with self.telemetry_lock:
+            if len(fields) in (3, 4) and fields[0] == "pos":
+                self.telemetry["pitch"] = int(fields[1])
+                self.telemetry["yaw"] = int(fields[2])
+                if len(fields) == 4:
+                    self.update_move(board, int(fields[3]))
+            elif len(fields) in (2, 3) and fields[0] == "zpos":
+                self.telemetry["zoom"] = int(fields[1])
+                if len(fields) == 3:
+                    self.update_move(board, int(fields[2]))
+            elif len(fields) in (3, 4) and fields[0] == "mv":
+                # mv start|done|stop <slot> <millis>, sent by the board the moment it happens
+                if fields[1] == "stop":
+                    self.stop_move(board)
+                    port = self.board_port(board)
+                    if port is not None:
+                        port.resynced()
+                    return
+                if fields[1] == "start":
+                    self.stopping.discard(board)
+                self.update_move(board, int(fields[2]) if fields[1] == "start" else 0)
+                if len(fields) == 4 and self.on_move_edge is not None and self.clock[board].synced():
+                    at = self.clock[board].to_host(int(fields[3]), host_ms())
+                    self.on_move_edge(self, board, fields[1], at)
+                return
+            elif len(fields) == 5 and fields[0] == "hello":
+                self.handle_hello(board, fields)
+                return
+            elif len(fields) == 2 and fields[0] == "cr":
+                port = self.board_port(board)
+                if port is not None:
+                    port.credit(int(fields[1]))
+                return
+            elif len(fields) == 5 and fields[0] == "enc":
+                self.handle_encoder(board, fields)
+                return
+            elif 3 <= len(fields) <= len(ARDUINO_TASKS) + 2 and fields[0] == "ovr":
+                self.handle_overruns(board, [int(v) for v in fields[1:-1]], int(fields[-1]))
+                return
+            elif len(fields) == 3 and fields[0] == "clk":
+                received = host_ms()
+                sent = self.pings.pop(int(fields[1]), None)
+                if sent is not None and sent[0] == board:
+                    self.clock[board].add(sent[1], received, int(fields[2]))
+                return
+            else:
+                return
+            self.broadcast({"rig": self.id, "tel": self.telemetry})
+        if fields[0] == "zpos":
+            self.relay_fov(int(fields[1]))
+
+    def serial_reader(self, port, board):
+        while not self.lost.is_set():
+            try:
+                line = port.readline().decode("ascii", "replace").strip()
+            except (serial.SerialException, TypeError, AttributeError) as e:
+                # closing the port under a blocked readline surfaces as one of these
+                if not self.lost.is_set():
+                    print("rig", self.id, "serial read failed", port.port, e)
+                self.lost.set()
+                return
+            try:
+                self.handle_board_line(line, board)
+            except ValueError:
+                print("rig", self.id, "bad line from", port.port, line)
@@ -0,0 +1,93 @@
+#pragma once
+// Just enough of the Arduino core to run a sketch natively on a virtual clock.
+// Every call costs a few microseconds so loop() passes take time, Serial input
+// arrives at 115200 baud from a queue the check fills and output is collected
+// behind a TX ring that drains at the same rate.
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define E2END 0x3FF
+#define SERIAL_RX_BUFFER_SIZE 64
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+#define F(x) x
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define constrain(a, l, h) ((a) < (l) ? (l) : ((a) > (h) ? (h) : (a)))
+typedef uint8_t byte;
+typedef bool boolean;
+
+extern uint64_t sim_us;
+extern int sim_pins[32];
+inline void pinMode(int, int) {}
+inline void digitalWrite(int p, int v) { sim_us += 4; sim_pins[p] = v; }
+inline int digitalRead(int p) { sim_us += 4; return sim_pins[p]; }
+inline unsigned long micros() { sim_us += 4; return (unsigned long)sim_us; }
+inline unsigned long millis() { sim_us += 2; return (unsigned long)(sim_us / 1000); }
+inline void delay(unsigned long ms) { sim_us += ms * 1000; }
+inline void delayMicroseconds(unsigned int us) { sim_us += us; }
+
+class Print {
+public:
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *b, size_t n) { for (size_t i = 0; i < n; i++) write(b[i]); return n; }
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long v, int base = DEC) { char b[24]; snprintf(b, 24, base == HEX ? "%lX" : "%ld", v); return print(b); }
+  size_t print(unsigned long v, int base = DEC) { char b[24]; snprintf(b, 24, base == HEX ? "%lX" : "%lu", v); return print(b); }
+  size_t print(int v, int base = DEC) { return print((long)v, base); }
+  size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v, base); }
+  size_t println() { return print("\r\n"); }
+  template <class T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template <class T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+  virtual int availableForWrite() { return 63; }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+class HardwareSerial : public Stream {
+public:
+  struct Byte { uint64_t at; uint8_t c; };
+  Byte queue[4096]; unsigned head = 0, tail = 0; // host to board, in arrival order
+  uint8_t ring[64]; int start = 0, count = 0;    // the core's RX buffer, overflow is lost
+  char out[1 << 16]; size_t outlen = 0;          // board to host, in the order written
+  uint64_t txDone = 0;                           // when the UART has sent all of it
+  void begin(unsigned long) {}
+  void send(uint64_t at, const char *s) {
+    for (; *s; s++) {
+      at = max(at, tail ? queue[tail - 1].at : 0) + 87;
+      queue[tail++] = { at, (uint8_t)*s };
+    }
+  }
+  void arrive() {
+    for (; head != tail && queue[head].at <= sim_us; head++) {
+      if (count < 63) ring[(start + count++) % 64] = queue[head].c;
+    }
+  }
+  int available() { arrive(); return count; }
+  int read() { arrive(); if (!count) return -1; int c = ring[start]; start = (start + 1) % 64; count--; return c; }
+  // the core's 64 byte TX ring drains at 115200 baud, a write to a full ring waits for room
+  int availableForWrite() { uint64_t queued = txDone > sim_us ? (txDone - sim_us + 86) / 87 : 0; return queued >= 63 ? 0 : 63 - (int)queued; }
+  size_t write(uint8_t c) {
+    if (availableForWrite() == 0) sim_us = txDone - 62 * 87;
+    txDone = max(txDone, sim_us) + 87;
+    if (outlen < sizeof(out) - 1) out[outlen++] = c;
+    return 1;
+  }
+  using Print::write;
+};
+extern HardwareSerial Serial;
@@ -0,0 +1,12 @@
+#pragma once
+#include "Arduino.h"
+// 1 KB of EEPROM, a write keeps the next access waiting 3.3 ms like the real one
+extern uint8_t sim_eeprom[E2END + 1];
+extern uint64_t sim_eeprom_ready;
+inline bool eeprom_is_ready() { return sim_us >= sim_eeprom_ready; }
+struct EEPROMClass {
+  uint8_t read(int i) { sim_us = max(sim_us, sim_eeprom_ready); return sim_eeprom[i]; }
+  void update(int i, uint8_t v) { if (read(i) != v) { sim_eeprom[i] = v; sim_eeprom_ready = sim_us + 3300; } }
+  template <class T> T &get(int i, T &t) { for (size_t k = 0; k < sizeof(T); k++) ((uint8_t *)&t)[k] = read(i + k); return t; }
+};
+extern EEPROMClass EEPROM;
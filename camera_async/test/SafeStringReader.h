@@ -0,0 +1,38 @@
+#pragma once
+#include "Arduino.h"
+// Just enough of SafeStringReader: space delimited tokens read from a Stream
+class SafeString {
+public:
+  char s[64]; unsigned len = 0;
+  static void setOutput(Print &) {}
+  bool operator==(const char *o) const { return strcmp(s, o) == 0; }
+  bool startsWith(const char *o) const { return strncmp(s, o, strlen(o)) == 0; }
+  void removeBefore(unsigned n) { n = min(n, len); memmove(s, s + n, len - n + 1); len -= n; }
+  bool toLong(long &v) const { char *e; if (!len) return false; long r = strtol(s, &e, 10); if (*e) return false; v = r; return true; }
+  bool toInt(int &v) const { long l; if (!toLong(l)) return false; v = (int)l; return true; }
+  const char *c_str() const { return s; }
+  void clear() { s[0] = 0; len = 0; }
+};
+class SafeStringReader : public SafeString {
+public:
+  Stream *in = nullptr; char part[64]; unsigned plen = 0; bool err = false;
+  bool read() {
+    clear();
+    while (in && in->available()) {
+      int c = in->read();
+      if (c != ' ') {
+        if (plen < 24) part[plen++] = c; else { err = true; plen = 0; }
+      } else if (plen) {
+        memcpy(s, part, plen); s[plen] = 0; len = plen; plen = 0;
+        return true;
+      }
+    }
+    return false;
+  }
+  bool hasError() { bool e = err; err = false; return e; }
+  int getDelimiter() { return ' '; }
+  void setTimeout(unsigned long) {}
+  void flushInput() { while (in && in->available()) in->read(); plen = 0; }
+  void connect(Stream &s) { in = &s; }
+};
+#define createSafeStringReader(name, size, delimiters) SafeStringReader name
@@ -0,0 +1,28 @@
+#pragma once
+#include "Arduino.h"
+// Two AS5600s on the motor shafts, 0x36 on pitch and 0x40 on yaw counting against
+// the steps. Each reads the shaft's real position in steps, sim_shaft[], which the
+// check moves along with the step count unless the motor is stalled or pushed.
+extern long sim_shaft[2];
+extern long sim_steps_per_turn;
+struct TwoWire {
+  uint8_t address = 0, reg = 0, buf[2]; int n = 0, pos = 0;
+  void begin() {}
+  void setClock(unsigned long) {}
+  void setWireTimeout(unsigned long = 25000, bool = false) {}
+  void beginTransmission(uint8_t a) { address = a; }
+  size_t write(uint8_t r) { reg = r; return 1; }
+  uint8_t endTransmission(bool = true) { sim_us += 45; return address == 0x36 || address == 0x40 ? 0 : 2; }
+  uint8_t requestFrom(uint8_t a, uint8_t count) {
+    sim_us += 25 + 23 * count;
+    long shaft = a == 0x40 ? -sim_shaft[1] : sim_shaft[0];
+    long angle = (shaft * 4096 / sim_steps_per_turn) % 4096;
+    angle += angle < 0 ? 4096 : 0;
+    buf[0] = reg == 0x0B ? 0x20 : angle >> 8; // magnet detected
+    buf[1] = angle & 0xFF;
+    n = count; pos = 0;
+    return count;
+  }
+  int read() { return pos < n ? buf[pos++] : -1; }
+};
+extern TwoWire Wire;
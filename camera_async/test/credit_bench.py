@@ -0,0 +1,58 @@
+"""Flow control on fake boards that stall, with and without credit.
+Run from anywhere: python3 camera_async/test/credit_bench.py
+
+4000 d<n> tokens go through Rig.forward_cmds at once into boards whose loop() stalls
+30 ms every 100 ms, long enough for the 64 byte serial buffer to overflow. Boards
+without credit model firmware from before cr. The main board's tokens are checked
+against what was sent, then the same run on boards that never stall gives the
+throughput credit leaves.
+"""
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+from fake_board import FakeBoard, start_rig  # noqa: E402
+
+TOKENS = ["d%d" % (n % 10000) for n in range(4000)]
+STALL = 0.03
+STALL_EVERY = 0.1
+
+
+def run(credit, stall):
+    r, main_board, zoom_board = start_rig(
+        main=FakeBoard("main", credit=credit, stall=stall, stall_every=STALL_EVERY),
+        zoom=FakeBoard("zoom", credit=credit, stall=stall, stall_every=STALL_EVERY),
+    )
+    time.sleep(1)
+    first = len(main_board.log)
+    r.forward_cmds(TOKENS)
+    while main_board.outgoing or main_board.ring:  # without credit the write is back long before
+        time.sleep(0.1)
+    time.sleep(0.1)
+    read = [(t, e) for t, e in main_board.log[first:] if e[:1] == "d"]
+    sent = set(TOKENS)
+    good = sum(1 for _, e in read if e in sent)
+    data = sum(len(e) + 1 for _, e in read)
+    seconds = read[-1][0] - read[0][0] if len(read) > 1 else 0
+    r.stop()
+    for board in (main_board, zoom_board):
+        board.close()
+    return good, main_board.dropped, data / seconds / 1000 if seconds else 0
+
+
+def main():
+    size = sum(len(t) + 1 for t in TOKENS)
+    for credit in (False, True):
+        good, dropped, _ = run(credit, STALL)
+        print(
+            "%s credit, stalling: %.1f of %.1f kB dropped, %d of %d tokens lost or garbled"
+            % ("with" if credit else "without", dropped / 1000, size / 1000, len(TOKENS) - good, len(TOKENS))
+        )
+    _, _, rate = run(True, 0)
+    print("with credit, keeping up: %.1f kB/s, %.0f%% of 115200 baud" % (rate, rate * 1000 / 11520 * 100))
+
+
+if __name__ == "__main__":
+    main()
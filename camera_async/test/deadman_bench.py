@@ -0,0 +1,41 @@
+"""How long after the last jog it heard a fake board stops when the controller hangs.
+Run from anywhere: python3 camera_async/test/deadman_bench.py
+
+The rig jogs at full speed with its heartbeat running, then the controller is frozen by
+holding serial_lock, which every write to the boards waits for. The time from the last j
+a board read to the end of its deadman ramp is what a hung controller costs.
+"""
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+from fake_board import start_rig  # noqa: E402
+
+RUNS = 10
+FREEZE = 0.6  # s
+
+
+def main():
+    r, main_board, zoom_board = start_rig()
+    time.sleep(1)
+    stops = []
+    for run in range(RUNS):
+        r.send_velocity({"pitch": 1000, "yaw": -1000, "zoom": 1000})
+        time.sleep(0.3)
+        with r.serial_lock:
+            time.sleep(FREEZE)
+            for board in (main_board, zoom_board):
+                last_jog = max(t for t, e in board.log if e.startswith("j") and e != "j0,0,0")
+                stop = board.events("deadman")[-1]
+                stops.append((stop - last_jog) * 1000)
+            r.velocity = (0, 0, 0)
+        print("run %2d: stopped %.0f / %.0f ms after the last j" % ((run + 1,) + tuple(stops[-2:])))
+        r.send_velocity({})
+        time.sleep(0.2)
+    print("stopped %.0f-%.0f ms after the last j" % (min(stops), max(stops)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,74 @@
+// Appended to camera_async.ino by encoder_check.sh. Drives the sketch with a
+// stalled pitch motor and a yaw shaft pushed by hand, and checks the board stops
+// on the stall, takes the encoder's position after the push and still lands on
+// its targets.
+uint64_t sim_us = 0;
+int sim_pins[32];
+uint8_t sim_eeprom[E2END + 1];
+uint64_t sim_eeprom_ready = 0;
+long sim_shaft[2];
+long sim_steps_per_turn = 3200;
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+TwoWire Wire;
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  failures += !ok;
+}
+
+static void run_until(uint64_t end, long stallAt)
+{
+  int last[2] = { iStepperPitchPos, iStepperYawPos };
+  while (sim_us < end) {
+    loop();
+    int pos[2] = { iStepperPitchPos, iStepperYawPos };
+    for (int a = 0; a < 2; a++) {
+      // a step the motor took turns the shaft, one the stalled pitch motor missed does not
+      if (pos[a] - last[a] == 1 || pos[a] - last[a] == -1) {
+        if (a != 0 || sim_shaft[0] != stallAt) {
+          sim_shaft[a] += pos[a] - last[a];
+        }
+      }
+      last[a] = pos[a];
+    }
+  }
+}
+
+static bool reported(const char *line)
+{
+  Serial.out[Serial.outlen] = 0;
+  return strstr(Serial.out, line) != NULL;
+}
+
+int main()
+{
+  memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+  setup();
+  uint64_t t0 = sim_us + 1000;
+  long fullStep = sim_steps_per_turn / FullStepsPerTurn;
+
+  Serial.send(t0, "Ep3200 Ey-3200 P1500 Y-800 ");
+  run_until(t0 + 6000000, 400);
+  expect(reported("enc on p 0 0") && reported("enc on y 0 0"), "both encoders on");
+  expect(reported("enc stall p"), "stall reported on pitch");
+  expect(iStepperPitchMove == 0 && iStepperYawMove == 0, "every axis stopped on the stall");
+  expect(iStepperPitchPos < 1500 && labs(iStepperPitchPos - sim_shaft[0]) < fullStep, "pitch took the encoder's position");
+
+  sim_shaft[1] += 150; // pushed by hand
+  run_until(sim_us + 1000000, -1);
+  expect(reported("enc fix y"), "fix reported on yaw");
+  expect(labs(iStepperYawPos - sim_shaft[1]) < fullStep, "yaw took the encoder's position");
+
+  Serial.send(sim_us, "P0 Y0 ");
+  run_until(sim_us + 8000000, -1);
+  expect(labs(sim_shaft[0]) < fullStep && labs(sim_shaft[1]) < fullStep, "both shafts back at 0");
+
+  if (failures) {
+    printf("%s\n", Serial.out);
+  }
+  return failures != 0;
+}
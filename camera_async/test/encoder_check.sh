@@ -0,0 +1,17 @@
+#!/bin/sh
+# Native check of the main board's encoder stall and fix paths against the mock AS5600s
+# in this directory. Needs only a host g++: sh camera_async/test/encoder_check.sh
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+sketch="$here/../camera_async.ino"
+out=${TMPDIR:-/tmp}/encoder_check
+# the Arduino builder declares every function before the sketch, functions taking a
+# struct are left out since it puts theirs after the struct definitions
+{
+  echo '#include <Arduino.h>'
+  grep -E '^[A-Za-z_][A-Za-z0-9_<>:*& ]* \**[A-Za-z_][A-Za-z0-9_]*\([^;]*\) *\{? *$' "$sketch" \
+    | grep -vE '^(if|else|while|for|switch|return)\b|PositionRecord|Encoder &' | sed -E 's/ *\{? *$/;/'
+  cat "$sketch" "$here/encoder_check.cpp"
+} > "$out.cpp"
+g++ -std=gnu++11 -O1 -Wall -Wextra -Werror -I"$here" -x c++ "$out.cpp" -o "$out"
+"$out"
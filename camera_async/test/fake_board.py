@@ -0,0 +1,348 @@
+"""Fake main and zoom boards on ptys, for running rig.py and the controller without
+hardware. Each board is a pty the controller opens like a serial port, behind which:
+
+- the bytes the host wrote wait in the OS until the wire carries them into a 63 byte RX
+  ring at 115200 baud, a byte that finds the ring full is lost like on the Uno;
+- a loop() thread drains the ring on every pass, acts on a stop byte at once, reads up
+  to 4 tokens every 1 ms and reports credit from the bytes it read, as the sketches do;
+- the head follows j velocities, timed and untimed P/Y/Z targets, presets, F, w and @
+  and reports pos/zpos every 20 ms and mv start/done/stop with its own drifting millis().
+
+Timing is taken from time.monotonic(), so results carry the host scheduler's noise
+(about a millisecond). Boards can stall every so often like a sketch stepping a burst or
+waiting on the EEPROM. Everything a board acted on is kept in its log with the true time,
+which is what the benches measure against.
+"""
+import os
+import pty
+import sys
+import select
+import threading
+import time
+import tty
+from collections import deque
+
+import serial
+
+BAUDRATE = 115200
+BYTE_TIME = 10 / BAUDRATE  # s per byte on the wire, 8N1
+RX_RING = 63  # bytes the core's 64 byte ring holds
+INPUT_SIZE = 64  # StopInput's buffer
+CREDIT_WINDOW = 62
+CREDIT_BATCH = 16
+STOP_BYTE = 0x18
+
+LOOP_PASS = 0.0005  # s between loop() passes
+INPUT_TICK = 0.001  # s, the input task
+INPUT_TOKENS = 4  # tokens per input tick
+TELEMETRY_TICK = 0.02
+DEADMAN_TICK = 0.01
+JOG_STOP_STEP = 100  # permille per deadman tick once the jog timed out
+
+JOG_SPEED = {"pitch": 500.0, "yaw": 800.0, "zoom": 300.0}  # steps/s at j1000
+MOVE_SPEED = 400.0  # steps/s of an untimed move
+SETPOINT_DIRECT = 5
+
+CAPS = 0x01 | 0x02 | 0x04 | 0x08 | 0x10 | 0x100 | 0x200 | 0x800  # see ARDUINO_CAP_* in rig.py
+CAP_FOV_SCALE = 0x20
+CAP_CREDIT = 0x400
+
+# the boards' threads must not wait out the interpreter's default 5 ms switch interval,
+# a 63 byte ring fills in 5.5 ms
+sys.setswitchinterval(0.0002)
+
+
+class FakeBoard:
+    """kind is "main" or "zoom". credit=False is firmware from before cr, drift_ppm how fast
+    its millis() runs, stall (s) a pause of loop() every stall_every s."""
+
+    def __init__(self, kind, credit=True, drift_ppm=0, stall=0, stall_every=0.1):
+        self.kind = kind
+        self.axes = ("pitch", "yaw") if kind == "main" else ("zoom",)
+        self.credit = credit
+        self.drift = drift_ppm / 1e6
+        self.stall = stall
+        self.stall_every = stall_every
+        self.lock = threading.Lock()
+        self.log = []  # (monotonic s, event), see note()
+        self.tokens = []  # every token read, in order
+        self.dropped = 0  # bytes lost to a full RX ring
+
+        self.master, slave = pty.openpty()
+        tty.setraw(slave)
+        self.port = os.ttyname(slave)
+        self.slave = slave  # kept open so the pty stays up between opens
+
+        self.outgoing = deque()  # written by the host, not on the wire yet
+        self.ring = deque()
+        self.wire_free = 0.0  # when the wire has carried the last byte
+
+        self.epoch = time.monotonic()
+        self.pos = {axis: 0.0 for axis in self.axes}
+        self.jog = {axis: 0 for axis in self.axes}  # permille
+        self.moves = {}  # axis -> (from, to, start, duration)
+        self.presets = {}
+        self.duration = 0
+        self.scheduled = None  # board millis the next move waits for
+        self.pending = None  # (slot, targets) held until scheduled
+        self.slot = 0  # setpoint being travelled to, 0 when idle
+        self.fov = 1000
+        self.jog_timeout = 0
+        self.jog_refreshed = 0.0
+        self.reported = None
+
+        self.running = True
+        threading.Thread(target=self.wire, daemon=True).start()
+        threading.Thread(target=self.loop, daemon=True).start()
+
+    def close(self):
+        self.running = False
+
+    def millis(self):
+        return int((time.monotonic() - self.epoch) * 1000 * (1 + self.drift)) & 0xFFFFFFFF
+
+    def note(self, event):
+        self.log.append((time.monotonic(), event))
+
+    def events(self, event):
+        return [t for t, e in self.log if e == event]
+
+    def out(self, line):
+        os.write(self.master, (line + "\r\n").encode("ascii"))
+
+    def flush_host(self):
+        """What reset_output_buffer() does to a real port: drop what the OS still holds"""
+        with self.lock:
+            self.outgoing.clear()
+
+    # the wire: host writes into the OS buffer, one byte per BYTE_TIME into the ring
+    def wire(self):
+        while self.running:
+            ready, _, _ = select.select([self.master], [], [], 0.0005)
+            now = time.monotonic()
+            with self.lock:
+                if not self.outgoing:
+                    self.wire_free = max(self.wire_free, now - BYTE_TIME)  # idle line
+                if ready:
+                    self.outgoing.extend(os.read(self.master, 4096))
+                while self.outgoing and self.wire_free + BYTE_TIME <= now:
+                    self.wire_free += BYTE_TIME
+                    byte = self.outgoing.popleft()
+                    if len(self.ring) < RX_RING:
+                        self.ring.append(byte)
+                    else:
+                        self.dropped += 1
+
+    # loop(): the stop lane first, then the tasks that are due
+    def loop(self):
+        buffer = deque()
+        token = bytearray()
+        taken = 0
+        credit_reported = 0
+        next_input = next_telemetry = next_deadman = time.monotonic()
+        next_stall = time.monotonic() + self.stall_every
+        while self.running:
+            now = time.monotonic()
+            if self.stall and now >= next_stall:
+                time.sleep(self.stall)
+                next_stall = time.monotonic() + self.stall_every
+                continue
+            with self.lock:
+                stop = False
+                while self.ring:
+                    byte = self.ring.popleft()
+                    if byte == STOP_BYTE:
+                        buffer.clear()
+                        stop = True
+                    elif len(buffer) < INPUT_SIZE:
+                        buffer.append(byte)
+            if stop:
+                token = bytearray()
+                taken = 0
+                self.stop_motion("stop")
+                if self.credit:
+                    credit_reported = 0
+                    self.out("cr %d" % CREDIT_WINDOW)
+            if now >= next_input:
+                next_input = max(next_input + INPUT_TICK, now - INPUT_TICK)
+                read = 0
+                while buffer and read < INPUT_TOKENS:
+                    byte = buffer.popleft()
+                    taken = (taken + 1) & 0xFFFF
+                    if byte != 0x20:
+                        token.append(byte)
+                    elif token:
+                        self.handle(token.decode("ascii", "replace"))
+                        token = bytearray()
+                        read += 1
+                unreported = (taken - credit_reported) & 0xFFFF
+                if self.credit and unreported and (unreported >= CREDIT_BATCH or not buffer):
+                    credit_reported = taken
+                    self.out("cr %d" % ((taken + CREDIT_WINDOW) & 0xFFFF))
+            if now >= next_deadman:
+                next_deadman = now + DEADMAN_TICK
+                self.deadman(now)
+            self.step(now)
+            if now >= next_telemetry:
+                next_telemetry = now + TELEMETRY_TICK
+                self.telemetry()
+            time.sleep(LOOP_PASS)
+
+    def handle(self, token):
+        self.tokens.append(token)
+        self.note(token)
+        now = time.monotonic()
+        if token == "hello":
+            caps = CAPS | (CAP_CREDIT if self.credit else 0) | (CAP_FOV_SCALE if self.kind == "main" else 0)
+            self.out("hello %s_module 1 0 %X" % (self.kind, caps))
+        elif token == "q":
+            self.telemetry(True)
+        elif token == "o":
+            self.out("ovr 0 0 0 0 0 0" if self.kind == "main" else "ovr 0 0 0 0 0")
+        elif token[:1] == "k" and token[1:].isdigit():
+            self.out("clk %s %d" % (token[1:], self.millis()))
+        elif token[:1] == "@" and token[1:].isdigit():
+            self.scheduled = int(token[1:])
+        elif token[:1] == "d" and token[1:].isdigit():
+            self.duration = int(token[1:])
+        elif token[:1] == "w" and token[1:].isdigit():
+            self.jog_timeout = int(token[1:]) / 1000
+            self.jog_refreshed = now
+        elif token[:1] == "F" and token[1:].isdigit() and self.kind == "main":
+            self.fov = max(50, min(1000, int(token[1:])))
+        elif token[:1] == "j":
+            try:
+                values = ([int(v) for v in token[1:].split(",")] + [0, 0, 0])[:3]
+            except ValueError:
+                return
+            if self.slot:
+                return  # a jog does not take over a move
+            self.jog_refreshed = now
+            for axis, value in zip(("pitch", "yaw", "zoom"), values):
+                if axis in self.axes:
+                    self.jog[axis] = max(-1000, min(1000, value))
+        elif token[:1] in ("s", "t") and (token[1:] == "" or token[1:].isdigit()):
+            slot = int(token[1:] or 1)
+            if token[0] == "s":
+                self.presets[slot] = dict(self.pos)
+            else:
+                self.start_move(slot, {axis: self.presets.get(slot, {}).get(axis, 0) for axis in self.axes})
+        elif token[:1] in ("P", "Y", "Z") and token[1:].lstrip("-").isdigit():
+            axis = {"P": "pitch", "Y": "yaw", "Z": "zoom"}[token[0]]
+            if axis in self.axes:
+                self.start_move(SETPOINT_DIRECT, {axis: int(token[1:])})
+
+    def start_move(self, slot, targets):
+        """Targets read in the same input tick make one move, like P Y Z after a d"""
+        if self.pending is not None:
+            targets = dict(self.pending[1], **targets)
+        self.pending = (slot, targets)
+        for axis in self.axes:
+            self.jog[axis] = 0
+
+    def begin(self, now):
+        """Start the pending move, once its scheduled time has come"""
+        if self.scheduled is not None:
+            if (self.millis() - self.scheduled) & 0xFFFFFFFF >= 0x80000000:
+                return  # stands still until then
+            self.scheduled = None
+        slot, targets = self.pending
+        self.pending = None
+        for axis, to in targets.items():
+            start = self.pos[axis]
+            seconds = self.duration / 1000 if self.duration else abs(to - start) / MOVE_SPEED
+            self.moves[axis] = (start, to, now, max(seconds, 1e-6))
+        if not self.slot or slot != self.slot:
+            self.slot = slot
+            self.note("start")
+            self.out("mv start %d %d" % (slot, self.millis()))
+
+    def step(self, now):
+        if self.pending is not None:
+            self.begin(now)
+        elapsed = now - getattr(self, "stepped", now)
+        self.stepped = now
+        for axis in self.axes:
+            if axis in self.moves:
+                start, to, t0, seconds = self.moves[axis]
+                done = min(1.0, (now - t0) / seconds)
+                self.pos[axis] = start + (to - start) * done
+                if done >= 1:
+                    del self.moves[axis]
+            elif self.jog[axis]:
+                scale = self.fov / 1000 if axis != "zoom" else 1
+                self.pos[axis] += JOG_SPEED[axis] * self.jog[axis] / 1000 * scale * elapsed
+        if self.slot and not self.moves and self.pending is None:
+            slot, self.slot = self.slot, 0
+            self.duration = 0  # d times everything up to the arrival, as on the boards
+            self.note("done")
+            self.out("mv done %d %d" % (slot, self.millis()))
+
+    def deadman(self, now):
+        if not self.jog_timeout or not any(self.jog.values()) or now - self.jog_refreshed < self.jog_timeout:
+            return
+        for axis, value in self.jog.items():
+            self.jog[axis] = max(value - JOG_STOP_STEP, 0) if value > 0 else min(value + JOG_STOP_STEP, 0)
+        if not any(self.jog.values()):
+            self.note("deadman")
+
+    def stop_motion(self, why):
+        slot = self.slot
+        self.moves = {}
+        self.pending = None
+        self.scheduled = None
+        self.duration = 0
+        self.slot = 0
+        for axis in self.axes:
+            self.jog[axis] = 0
+        self.note(why)
+        self.out("mv stop %d %d" % (slot, self.millis()))
+
+    def telemetry(self, force=False):
+        values = [round(self.pos[axis]) for axis in self.axes]
+        if not force and (values, self.slot) == self.reported:
+            return
+        self.reported = (values, self.slot)
+        if self.kind == "main":
+            self.out("pos %d %d %d" % (values[0], values[1], self.slot))
+        else:
+            self.out("zpos %d %d" % (values[0], self.slot))
+
+
+def boards_by_port(boards):
+    return {board.port: board for board in boards}
+
+
+def patch_serial(boards):
+    """Let reset_output_buffer() on a fake board's port drop what its wire still holds, a
+    pty keeps it otherwise. Returns a function that undoes the patch."""
+    by_port = boards_by_port(boards)
+    reset = serial.Serial.reset_output_buffer
+
+    def reset_output_buffer(port):
+        board = by_port.get(port.port)
+        if board is not None:
+            board.flush_host()
+        reset(port)
+
+    serial.Serial.reset_output_buffer = reset_output_buffer
+    return lambda: setattr(serial.Serial, "reset_output_buffer", reset)
+
+
+def start_rig(rig_id="fake", broadcast=None, main=None, zoom=None, **options):
+    """A rig.Rig on a fresh pair of fake boards, returned once it is online with both
+    hellos in. Extra options go to Rig."""
+    import rig
+
+    rig.ARDUINO_RESET_WAIT = 0.2  # nothing resets
+    main = main or FakeBoard("main")
+    zoom = zoom or FakeBoard("zoom")
+    patch_serial([main, zoom])
+    r = rig.Rig(rig_id, main.port, zoom.port, broadcast or (lambda msg: None), [], **options)
+    r.start()
+    deadline = time.monotonic() + 5
+    while not (r.online and len(r.boards) == 2):
+        if time.monotonic() > deadline:
+            raise RuntimeError("fake rig did not come up")
+        time.sleep(0.01)
+    return r, main, zoom
@@ -0,0 +1,111 @@
+"""Sender to move start latency of an HTTP /batch recall against an OSC recall.
+Run from anywhere: python3 camera_async/test/latency_bench.py
+
+Runs the controller (CameraController.py, gamepad stubbed out) and the command server
+(node cmd_server/server.js, needs its npm install and node on the PATH) on a fake rig,
+then recalls two presets in turn, once through HTTP GET /batch on port 8080 and once
+as /camera/preset/recall on OSC port 9000. The time is taken from just before the
+request leaves this process to the main board starting the move, so the HTTP path
+includes server.js and its TCP hop to the controller. Ports 8080, 8081, 9000 and 52381
+must be free.
+"""
+import http.client
+import json
+import os
+import runpy
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import types
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, ".."))
+
+import rig  # noqa: E402
+from fake_board import FakeBoard, patch_serial  # noqa: E402
+
+TRIALS = 20
+MOVE_TIME = 0.6  # s to let each recall land, 100 steps apart
+SERVER = os.path.join(here, "..", "..", "cmd_server", "server.js")
+
+
+def osc_message(address, *args):
+    def pad(b):
+        return b + b"\0" * (4 - len(b) % 4)
+
+    tags = "," + "".join("i" for _ in args)
+    return pad(address.encode("ascii")) + pad(tags.encode("ascii")) + b"".join(struct.pack(">i", a) for a in args)
+
+
+def start_controller(main, zoom):
+    rig.ARDUINO_RESET_WAIT = 0.2  # nothing resets
+    patch_serial([main, zoom])
+    rigs = os.path.join(tempfile.mkdtemp(), "rigs.json")
+    with open(rigs, "w") as f:
+        json.dump([{"id": "1", "port": main.port, "zoom_port": zoom.port}], f)
+    os.environ["CAMERA_RIGS"] = rigs
+    # the gamepad loop waits for events that never come
+    sys.modules["inputs"] = types.SimpleNamespace(get_gamepad=lambda: threading.Event().wait() or [])
+    controller = os.path.join(here, "..", "CameraController.py")
+    threading.Thread(target=runpy.run_path, args=(controller,), kwargs={"run_name": "__main__"}, daemon=True).start()
+
+
+def wait_for_start(board, seen, sent):
+    deadline = time.monotonic() + 2
+    while time.monotonic() < deadline:
+        starts = [t for t, e in board.log[seen:] if e == "start"]
+        if starts:
+            return (starts[0] - sent) * 1000
+        time.sleep(0.001)
+    raise SystemExit("no mv start within 2 s")
+
+
+def main():
+    main_board, zoom_board = FakeBoard("main"), FakeBoard("zoom")
+    start_controller(main_board, zoom_board)
+    server = subprocess.Popen(["node", SERVER])
+    try:
+        time.sleep(3)  # boards online, server connected
+        http_conn = http.client.HTTPConnection("127.0.0.1", 8080)
+
+        def batch(*cmds):
+            http_conn.request("GET", "/batch?" + "&".join("cmd=" + c for c in cmds))
+            return http_conn.getresponse().read()
+
+        batch("P0", "Y0")
+        time.sleep(MOVE_TIME)
+        batch("s")
+        batch("P100")
+        time.sleep(MOVE_TIME)
+        batch("s2")
+        udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+
+        results = {"http": [], "osc": []}
+        for trial in range(TRIALS):
+            slot = 1 if trial % 2 == 0 else 2
+            for path in ("http", "osc"):
+                seen = len(main_board.log)
+                sent = time.monotonic()
+                if path == "http":
+                    batch("t" if slot == 1 else "t2")
+                else:
+                    udp.sendto(osc_message("/camera/preset/recall", slot), ("127.0.0.1", 9000))
+                results[path].append(wait_for_start(main_board, seen, sent))
+                time.sleep(MOVE_TIME)
+                slot = 3 - slot
+        for path, times in results.items():
+            times.sort()
+            print(
+                "%s: min %.1f median %.1f max %.1f ms sender to mv start"
+                % (path, times[0], times[len(times) // 2], times[-1])
+            )
+    finally:
+        server.terminate()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,48 @@
+// Appended to a sketch by loop_check.sh. Feeds it what the controller sends on a
+// busy connection, jogs every 40 ms and clock sync bursts with task stats every
+// 100 ms, and fails if a loop() pass ever held the steppers up for longer than
+// MaxPass, as one waiting on a full TX ring would.
+uint64_t sim_us = 0;
+int sim_pins[32];
+uint8_t sim_eeprom[E2END + 1];
+uint64_t sim_eeprom_ready = 0;
+long sim_shaft[2];
+long sim_steps_per_turn = 3200;
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+#ifdef SIM_WIRE
+TwoWire Wire;
+#endif
+
+static const uint64_t MaxPass = 200; // us
+static const uint64_t Run = 5000000; // us
+
+int main()
+{
+  memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+  setup();
+  uint64_t t0 = sim_us + 1000;
+  Serial.send(t0, "w150 hello q ");
+  char cmd[96];
+  int ping = 0;
+  for (int n = 1; n * 40000ULL < Run; n++) {
+    uint64_t at = t0 + n * 40000ULL;
+    snprintf(cmd, sizeof(cmd), "j%d,%d,%d ", n % 3 * 400 - 400, 500, -300);
+    Serial.send(at, cmd);
+    if (n % 5 == 0) {
+      snprintf(cmd, sizeof(cmd), "hello k%d k%d k%d k%d o ", ping + 1, ping + 2, ping + 3, ping + 4);
+      ping += 4;
+      Serial.send(at + 1000, cmd);
+    }
+  }
+  uint64_t worst = 0;
+  while (sim_us < t0 + Run) {
+    uint64_t start = sim_us;
+    loop();
+    if (sim_us - start > worst) {
+      worst = sim_us - start;
+    }
+  }
+  printf("%s worst loop() pass %lu us\n", worst <= MaxPass ? "ok  " : "FAIL", (unsigned long)worst);
+  return worst <= MaxPass ? 0 : 1;
+}
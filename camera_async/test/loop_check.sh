@@ -0,0 +1,26 @@
+#!/bin/sh
+# Native check that replies never hold up a sketch's loop() behind the TX ring, run
+# against both sketches or the one given. Needs only a host g++:
+# sh camera_async/test/loop_check.sh [sketch.ino]
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+out=${TMPDIR:-/tmp}/loop_check
+status=0
+if [ $# -eq 0 ]; then
+  set -- "$here/../camera_async.ino" "$here/../../camera_zoom_async/camera_zoom_async.ino"
+fi
+for s in "$@"; do
+  # the Arduino builder declares every function before the sketch, functions taking a
+  # struct are left out since it puts theirs after the struct definitions
+  {
+    echo '#include <Arduino.h>'
+    grep -q '<Wire.h>' "$s" && echo '#define SIM_WIRE'
+    grep -E '^[A-Za-z_][A-Za-z0-9_<>:*& ]* \**[A-Za-z_][A-Za-z0-9_]*\([^;]*\) *\{? *$' "$s" \
+      | grep -vE '^(if|else|while|for|switch|return)\b|PositionRecord|Encoder &' | sed -E 's/ *\{? *$/;/'
+    cat "$s" "$here/loop_check.cpp"
+  } > "$out.cpp"
+  g++ -std=gnu++11 -O1 -Wall -Wextra -Werror -I"$here" -x c++ "$out.cpp" -o "$out"
+  printf '%s: ' "$(basename "$s")"
+  "$out" || status=1
+done
+exit $status
@@ -0,0 +1,74 @@
+"""Record a jog take on fake boards, replay it and compare the two.
+Run from anywhere: python3 camera_async/test/replay_bench.py
+
+The take is a few seconds of changing pan/tilt/zoom jogs sent like the gamepad does. The
+replay is recorded the same way and lined up with the take at the tick where it left the
+first sample. A replayed sample is within one tick when every axis lies between the take's
+samples one tick before and one tick after.
+"""
+import os
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+import recording  # noqa: E402
+from fake_board import start_rig  # noqa: E402
+
+JOGS = [(600, 0, 0), (600, -400, 200), (0, -1000, 0), (-300, 500, -600), (1000, 1000, 1000), (0, 0, 0)]
+JOG_TIME = 0.6  # s per jog
+SLACK = 1  # step, telemetry is rounded
+
+
+def take(r, path, action):
+    recorder = recording.Recorder(r, path)
+    action()
+    recorder.stop()
+    time.sleep(0.1)
+    return recording.load(path)[1]
+
+
+def within_one_tick(recorded, replayed):
+    outside = 0
+    for i, (_, pos) in enumerate(replayed):
+        window = [p for _, p in recorded[max(0, i - 1):i + 2]]
+        if not all(min(w[a] for w in window) - SLACK <= pos[a] <= max(w[a] for w in window) + SLACK for a in range(3)):
+            outside += 1
+    return outside
+
+
+def main():
+    r, _, _ = start_rig()
+    time.sleep(1)
+    directory = tempfile.mkdtemp()
+
+    def jog():
+        for vel in JOGS:
+            r.send_velocity(dict(zip(("pitch", "yaw", "zoom"), vel)))
+            time.sleep(JOG_TIME)
+
+    recorded = take(r, os.path.join(directory, "take.cmrr"), jog)
+    first = next(i for i, (vel, _) in enumerate(recorded) if vel != (0, 0, 0))
+    recorded = recorded[max(0, first - 1):]
+
+    done = threading.Event()
+
+    def replay():
+        recording.Replayer(r, recorded, recording.CONTROL_TICK_MS, on_done=lambda _, error: done.set())
+        done.wait()
+        time.sleep(0.2)
+
+    replayed = take(r, os.path.join(directory, "replay.cmrr"), replay)
+    start = recorded[0][1]
+    left = next(i for i, (_, pos) in enumerate(replayed) if i > 0 and replayed[i - 1][1] == start and pos != start)
+    replayed = replayed[left - 1:left - 1 + len(recorded)]
+
+    worst = max(max(abs(p - q) for p, q in zip(a[1], b[1])) for a, b in zip(recorded, replayed))
+    print("%d ticks replayed, worst position error %d steps" % (len(replayed), worst))
+    print("%d ticks outside one tick of the take" % within_one_tick(recorded, replayed))
+
+
+if __name__ == "__main__":
+    main()
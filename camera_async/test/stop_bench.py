@@ -0,0 +1,53 @@
+"""Press to stop on fake boards with a backlog queued, the stop byte against a plain j0.
+Run from anywhere: python3 camera_async/test/stop_bench.py
+
+Each trial jogs the head, queues 400 tokens through forward_cmds from another thread the
+way a burst of remote commands would, and stops 20 ms later. The time is taken from the
+press to the moment each board stopped, by the stop byte or by reading the j0.
+"""
+import os
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+from fake_board import start_rig  # noqa: E402
+
+BACKLOG = ["d100"] * 400
+TRIALS = 5
+
+
+def trial(r, boards, stop):
+    r.send_velocity({"pitch": 500, "yaw": 500, "zoom": 500})
+    time.sleep(0.2)
+    backlog = threading.Thread(target=r.forward_cmds, args=(BACKLOG,))
+    backlog.start()
+    time.sleep(0.02)
+    pressed = time.monotonic()
+    seen = [len(board.log) for board in boards]
+    stop()
+    backlog.join()
+    time.sleep(0.5)
+    times = []
+    for board, n in zip(boards, seen):
+        t = next(t for t, e in board.log[n:] if e in ("stop", "j0,0,0"))
+        times.append((t - pressed) * 1000)
+    r.send_velocity({})
+    time.sleep(0.3)
+    return times
+
+
+def main():
+    r, main_board, zoom_board = start_rig()
+    time.sleep(1)
+    boards = (main_board, zoom_board)
+    for name, stop in (("stop byte", r.estop), ("plain j0", lambda: r.send_velocity({}))):
+        times = []
+        for _ in range(TRIALS):
+            times += trial(r, boards, stop)
+        print("%s: %.1f-%.1f ms press to stop" % (name, min(times), max(times)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,48 @@
+"""Start skew of scheduled moves across two rigs on fake boards whose clocks drift.
+Run from anywhere: python3 camera_async/test/sync_bench.py
+
+Each board's millis() runs off by up to 3000 ppm and the rigs fit offset and drift from
+their k/clk round trips as they do on hardware. Every trial schedules a timed move on all
+four boards 250 ms ahead, like /sync, and compares when each board really started it with
+the time it was given and with the other boards.
+"""
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+import rig  # noqa: E402
+from fake_board import FakeBoard, start_rig  # noqa: E402
+
+DRIFT_PPM = ((3000, -1500), (-3000, 1000))  # main, zoom per rig
+SETTLE = 12  # s of clock sync before the first trial, a few 2 s ping rounds
+TRIALS = 10
+LEAD = 250  # ms, /sync's default
+
+
+def main():
+    rigs = []
+    for n, (main_ppm, zoom_ppm) in enumerate(DRIFT_PPM, 1):
+        rigs.append(start_rig(str(n), main=FakeBoard("main", drift_ppm=main_ppm), zoom=FakeBoard("zoom", drift_ppm=zoom_ppm)))
+    print("syncing clocks for", SETTLE, "s")
+    time.sleep(SETTLE)
+    worst_error = worst_skew = 0
+    for trial in range(TRIALS):
+        at = rig.host_ms() + LEAD
+        target = 200 if trial % 2 == 0 else 0
+        for r, _, _ in rigs:
+            error = r.schedule_cmds(["d200", "P%d" % target, "Z%d" % target], at)
+            if error is not None:
+                raise SystemExit(error)
+        time.sleep(LEAD / 1000 + 0.4)
+        starts = [board.events("start")[-1] * 1000 for _, main, zoom in rigs for board in (main, zoom)]
+        error = max(abs(s - at) for s in starts)
+        skew = max(starts) - min(starts)
+        worst_error, worst_skew = max(worst_error, error), max(worst_skew, skew)
+        print("trial %2d: start error %.1f ms, skew %.1f ms" % (trial + 1, error, skew))
+    print("worst start error %.1f ms, worst skew %.1f ms" % (worst_error, worst_skew))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,196 @@
+"""VISCA over IP (UDP) so hardware PTZ controllers, vMix and OBS plugins can
+drive the rig like any other PTZ camera.
+
+Both the Sony framing (8 byte header, port 52381) and raw VISCA packets
+(no header, as sent by PTZOptics style controllers) are accepted, replies
+use the same framing as the request.
+
+Supported commands:
+    8x 01 06 01 VV WW 0p 0q FF              pan-tilt drive, VV 01-18 WW 01-14
+    8x 01 06 02 VV WW 0Y.. 0Z 0Z 0Z 0Z FF   pan-tilt absolute, 4 or 5 pan nibbles
+    8x 01 04 07 00/02/03/2p/3p FF           zoom stop, tele, wide, variable p 0-7
+    8x 01 04 47 0p 0q 0r 0s FF              zoom direct
+    8x 01 04 3F 01/02 pp FF                 memory set/recall, pp 00-03 is slot 1-4
+    8x 09 06 12 FF                          pan-tilt position inquiry
+    8x 09 04 47 FF                          zoom position inquiry
+    8x 09 04 00 FF                          power inquiry, always on
+
+Positions are raw motor steps, clamped to the 16 bit range VISCA carries.
+Pan right is +yaw, tilt up is -pitch and tele is +zoom, same as the gamepad.
+Absolute moves ignore the VV/WW speed bytes and run at the board's set speed.
+"""
+import socketserver
+import struct
+import time
+
+VISCA_PAN_SPEED_MAX = 0x18
+VISCA_TILT_SPEED_MAX = 0x14
+VISCA_ZOOM_SPEED_MAX = 7
+VISCA_JOG_MAX = 1000  # permille, see ARDUINO_JOG_MAX
+
+# Sony header payload types
+VISCA_COMMAND = 0x0100
+VISCA_INQUIRY = 0x0110
+VISCA_REPLY = 0x0111
+VISCA_CONTROL = 0x0200
+VISCA_CONTROL_REPLY = 0x0201
+
+VISCA_SYNTAX_ERROR = b"\x60\x02"
+VISCA_NOT_EXECUTABLE = b"\x61\x41"
+
+
+class ViscaError(Exception):
+    def __init__(self, code):
+        super().__init__(code.hex())
+        self.code = code
+
+
+def speed_value(speed, fastest):
+    return max(1, min(fastest, speed)) * VISCA_JOG_MAX // fastest
+
+
+def nibbles(data):
+    """Decode 0x0n bytes, most significant first"""
+    value = 0
+    for b in data:
+        value = (value << 4) | (b & 0x0F)
+    return value
+
+
+def to_nibbles(value, count):
+    return bytes((value >> (4 * i)) & 0x0F for i in reversed(range(count)))
+
+
+def signed(value, count):
+    if value >= 1 << (4 * count - 1):
+        value -= 1 << (4 * count)
+    return value
+
+
+def clamp16(value, low=-0x8000, high=0x7FFF):
+    return max(low, min(high, value))
+
+
+class ViscaServer(socketserver.UDPServer):
+    """Single threaded on purpose, datagrams are applied in the order they arrive"""
+
+    # no SO_REUSEADDR: on UDP it would let a second rig bind the same port and take its datagrams
+    allow_reuse_address = False
+
+    def __init__(self, address, forward_cmds, record_latency, telemetry):
+        super().__init__(address, ViscaHandler)
+        self.forward_cmds = forward_cmds
+        self.record_latency = record_latency
+        self.telemetry = telemetry  # returns a snapshot of TELEMETRY
+        self.jog = {"pitch": 0, "yaw": 0, "zoom": 0}  # drive and zoom commands only change their own axes
+
+    def jog_cmd(self):
+        return ["j%d,%d,%d" % (self.jog["pitch"], self.jog["yaw"], self.jog["zoom"])]
+
+    def translate(self, packet):
+        """Map one VISCA command onto firmware tokens"""
+        body = packet[1:-1]
+
+        if body[:3] == b"\x01\x06\x01" and len(body) == 7:
+            pan_speed = speed_value(body[3], VISCA_PAN_SPEED_MAX)
+            tilt_speed = speed_value(body[4], VISCA_TILT_SPEED_MAX)
+            yaw = {1: -pan_speed, 2: pan_speed, 3: 0}[body[5]]
+            pitch = {1: -tilt_speed, 2: tilt_speed, 3: 0}[body[6]]
+            self.jog["yaw"], self.jog["pitch"] = yaw, pitch
+            return self.jog_cmd()
+
+        if body[:3] == b"\x01\x06\x02" and len(body) in (13, 14):
+            pan_count = len(body) - 9
+            pan = signed(nibbles(body[5 : 5 + pan_count]), pan_count)
+            tilt = signed(nibbles(body[5 + pan_count :]), 4)
+            self.jog["pitch"] = self.jog["yaw"] = 0
+            return self.jog_cmd() + ["P%d" % -tilt, "Y%d" % pan]
+
+        if body[:3] == b"\x01\x04\x07" and len(body) == 4:
+            p = body[3]
+            if p == 0x00:
+                self.jog["zoom"] = 0
+            elif p in (0x02, 0x03):
+                self.jog["zoom"] = VISCA_JOG_MAX // 2 * (1 if p == 0x02 else -1)
+            elif p >> 4 in (2, 3) and p & 0x0F <= VISCA_ZOOM_SPEED_MAX:
+                speed = ((p & 0x0F) + 1) * VISCA_JOG_MAX // (VISCA_ZOOM_SPEED_MAX + 1)
+                self.jog["zoom"] = speed if p >> 4 == 2 else -speed
+            else:
+                raise ViscaError(VISCA_SYNTAX_ERROR)
+            return self.jog_cmd()
+
+        if body[:3] == b"\x01\x04\x47" and len(body) == 7:
+            self.jog["zoom"] = 0
+            return self.jog_cmd() + ["Z%d" % nibbles(body[3:])]
+
+        if body[:3] == b"\x01\x04\x3f" and len(body) == 5:
+            if body[4] > 3:
+                raise ViscaError(VISCA_NOT_EXECUTABLE)
+            slot = "" if body[4] == 0 else str(body[4] + 1)
+            if body[3] == 0x01:
+                return ["s" + slot]
+            if body[3] == 0x02:
+                return ["t" + slot]
+            raise ViscaError(VISCA_NOT_EXECUTABLE)  # memory reset, presets are only ever overwritten
+
+        raise ViscaError(VISCA_SYNTAX_ERROR)
+
+    def inquire(self, packet):
+        """Answer an inquiry from the latest telemetry, returns the reply body after 9y 50"""
+        body = packet[1:-1]
+        tel = self.telemetry()
+        if body == b"\x09\x06\x12":
+            return to_nibbles(clamp16(tel["yaw"]) & 0xFFFF, 4) + to_nibbles(clamp16(-tel["pitch"]) & 0xFFFF, 4)
+        if body == b"\x09\x04\x47":
+            return to_nibbles(clamp16(tel["zoom"], 0, 0xFFFF), 4)
+        if body == b"\x09\x04\x00":
+            return b"\x02"
+        raise ViscaError(VISCA_SYNTAX_ERROR)
+
+
+class ViscaHandler(socketserver.BaseRequestHandler):
+    def reply(self, payload_type, seq, payload):
+        sock = self.request[1]
+        if seq is None:
+            sock.sendto(payload, self.client_address)
+        else:
+            sock.sendto(struct.pack(">HHI", payload_type, len(payload), seq) + payload, self.client_address)
+
+    def handle(self):
+        received = time.perf_counter()
+        data = self.request[0]
+        seq = None
+        payload_type = None
+        if len(data) >= 8 and data[0] & 0xF0 != 0x80:
+            payload_type, length, seq = struct.unpack_from(">HHI", data)
+            data = data[8 : 8 + length]
+            if payload_type == VISCA_CONTROL:
+                # reset sequence number, nothing to reset since every datagram is answered
+                self.reply(VISCA_CONTROL_REPLY, seq, b"\x01")
+                return
+
+        if len(data) < 3 or data[0] & 0xF0 != 0x80 or data[-1] != 0xFF:
+            print("bad visca packet from", self.client_address, data.hex())
+            return
+        head = bytes([((data[0] & 0x07) + 8) << 4])
+
+        try:
+            if data[1] == 0x09:
+                self.reply(VISCA_REPLY, seq, head + b"\x50" + self.server.inquire(data) + b"\xff")
+                return
+            cmds = self.server.translate(data)
+        except ViscaError as e:
+            self.reply(VISCA_REPLY, seq, head + e.code + b"\xff")
+            return
+        except (KeyError, IndexError):
+            self.reply(VISCA_REPLY, seq, head + VISCA_SYNTAX_ERROR + b"\xff")
+            return
+
+        error = self.server.forward_cmds(cmds)
+        if error is not None:
+            print("visca", cmds, error)
+            self.reply(VISCA_REPLY, seq, head + VISCA_NOT_EXECUTABLE + b"\xff")
+            return
+        self.server.record_latency("visca", received)
+        self.reply(VISCA_REPLY, seq, head + b"\x41\xff")
+        self.reply(VISCA_REPLY, seq, head + b"\x51\xff")
@@ -1,11 +1,127 @@
+#include <EEPROM.h>
 #include "SafeStringReader.h"
 
+// Build identity for the hello frame. upload_to_boards.py defines FIRMWARE_HASH
+// from the sketch sources, a build from the IDE reports 0.
+#ifndef FIRMWARE_HASH
+#define FIRMWARE_HASH  0
+#endif
+const int ProtocolVersion =  1;
+
+// Capability bits in the hello frame, the same bits on both boards
+const unsigned int CapTelemetry =  0x01; // zpos lines
+const unsigned int CapJog =  0x02; // j velocity
+const unsigned int CapTarget =  0x04; // Z absolute target
+const unsigned int CapTimedMove =  0x08; // d<ms>
+const unsigned int CapClock =  0x10; // k ping, @ scheduled start, timestamped mv lines
+const unsigned int CapSoftLimits =  0x40; // Lz<min>,<max>, ea/eb
+const unsigned int CapPositionJournal =  0x80; // zoom position kept across resets, no homing after a clean stop
+const unsigned int CapJogDeadman =  0x100; // w<ms>, a jog not refreshed in time ramps to a stop
+const unsigned int CapStopLane =  0x200; // StopByte halts the lens ahead of queued tokens
+const unsigned int CapCredit =  0x400; // cr <limit> flow control
+const unsigned int CapTaskStats =  0x800; // o, answered with ovr <overruns per task>
+const unsigned int Capabilities = CapTelemetry | CapJog | CapTarget | CapTimedMove | CapClock | CapSoftLimits
+  | CapPositionJournal | CapJogDeadman | CapStopLane | CapCredit | CapTaskStats;
+
 // Pin definitions
 const int StepZ =  4;
 const int DirZ =  7;
 
 // Stepper motor control
-createSafeStringReader(sfReader,  16, " "); // Reader for up to  20 chars, tokens terminated by space or timeout
+createSafeStringReader(sfReader,  24, " "); // Reader for up to  24 chars, tokens terminated by space or timeout
+
+// Stop lane, as on the main board: the reader reads through StopInput, which drains
+// the serial buffer every loop pass and stops the lens the moment a StopByte shows up,
+// dropping whatever arrived before it.
+const uint8_t StopByte =  0x18; // CAN
+const int StopInputSize =  64;
+
+// Credit, as on the main board: cr <bytes read + CreditWindow> tells the host how far
+// it may write, the RX ring less one byte for a StopByte. Unread input always fits
+// StopInput's buffer, so the ring is emptied on every poll and a StopByte seen at once.
+const unsigned int CreditWindow = SERIAL_RX_BUFFER_SIZE -  2;
+const unsigned int CreditBatch =  16; // bytes taken before a report while more are waiting
+
+class StopInput : public Stream {
+public:
+  // true when a StopByte came in since the last poll
+  bool poll() {
+    bool stop = false;
+    while (Serial.available() >  0) {
+      int c = Serial.read();
+      if (c == StopByte) {
+        start =  0;
+        count =  0;
+        taken =  0;
+        stop = true;
+      } else if (count < StopInputSize) {
+        buffer[(start + count) % StopInputSize] = c;
+        count++;
+      }
+      // else dropped, only a host past its credit gets here and a StopByte behind it is still seen
+    }
+    return stop;
+  }
+  int available() { return count; }
+  int peek() { return count >  0 ? buffer[start] : -1; }
+  int read() {
+    if (count ==  0) {
+      return -1;
+    }
+    uint8_t c = buffer[start];
+    start = (start +  1) % StopInputSize;
+    count--;
+    taken++;
+    return c;
+  }
+  size_t write(uint8_t c) { return Serial.write(c); }
+  // bytes read since boot or the last StopByte
+  unsigned int taken_count() { return taken; }
+
+private:
+  uint8_t buffer[StopInputSize];
+  int start =  0;
+  int count =  0;
+  unsigned int taken =  0;
+};
+StopInput SerialInput;
+unsigned int CreditReported =  0; // taken count in the last cr line
+
+// Transmit queue, as on the main board: replies and events go through Tx and are moved
+// on to the core's TX ring as far as it has room, never dropped. Telemetry bypasses it.
+const int TxQueueSize =  128;
+
+class TxQueue : public Print {
+public:
+  using Print::write;
+  size_t write(uint8_t c) {
+    if (count == TxQueueSize) {
+      Serial.write(pop());
+    }
+    buffer[(start + count) % TxQueueSize] = c;
+    count++;
+    return  1;
+  }
+  // true once everything queued is with the core
+  bool drain() {
+    while (count >  0 && Serial.availableForWrite() >  0) {
+      Serial.write(pop());
+    }
+    return count ==  0;
+  }
+
+private:
+  uint8_t pop() {
+    uint8_t c = buffer[start];
+    start = (start +  1) % TxQueueSize;
+    count--;
+    return c;
+  }
+  uint8_t buffer[TxQueueSize];
+  int start =  0;
+  int count =  0;
+};
+TxQueue Tx;
 unsigned long StepTimer;
 
 // Zoom control
@@ -19,14 +135,19 @@ enum Setpoint {
   SETPOINT_A =  1,
   SETPOINT_B =  2,
   SETPOINT_C =  3,
-  SETPOINT_D =  4
+  SETPOINT_D =  4,
+  SETPOINT_DIRECT =  5 // absolute target from Z rather than a stored preset
 };
 
 int BlockUserInput =  0;
 int SetpointStarted =  0;
 
+// Zoom travel limits (ea/eb or Lz<min>,<max>). Approaching one the step interval is
+// stretched so the lens could still stop on it at ZoomLimitDecel, targets are clamped.
 int StoredZoomAStop =  0;
 int StoredZoomBStop =  1490;
+const long ZoomLimitDecel =  8000; // steps/s^2
+const long LimitRampSteps =  1000; // further out than this no speed needs slowing
 
 int StoredZoomSpeed =  2000 *  1;
 int TargetZoomPos =  0;
@@ -37,10 +158,84 @@ int StoredZoomPosD =  0;
 
 // Stepper motor state
 int iStepperSpeedRamp =  0;
-int iStepperZoomSpeed =  2000 *  0.65;
+long iStepperZoomSpeed =  2000 *  0.65;
 ZoomDirection iStepperZoomMove = ZOOM_STOP;
 int iStepperZoomPos =  0;
 
+// Homing, a sweep to the wide end stop at boot when no clean stop was journaled. It is
+// stepped like any move, input waits until it is done. A sweep cut short by a stop
+// leaves the position unknown: it is never journaled, so the next boot homes again,
+// unless ea sets the zero by hand.
+const int ZoomHomingSteps =  1141;
+int HomingSteps =  0; // left in the sweep
+bool ZoomHomed = true; // iStepperZoomPos is where the lens really is
+
+// Jog velocity (third field of j<pitch>,<yaw>,<zoom>, permille) scales this interval
+const long JogMaxInterval =  20000;
+long JogZoomSpeed =  2000 *  0.65;
+long JogZoom =  0; // last j velocity, what the deadman ramps down
+
+// Jog deadman (w<ms>, 0 is off), the same as on the main board: a jog that is not
+// repeated within JogTimeout is ramped down by JogStopStep every JogStopTick.
+unsigned long JogTimeout =  0; // ms
+const unsigned long JogStopTick =  10; // ms, the deadman task's period
+const long JogStopStep =  100; // permille per tick
+unsigned long JogRefreshed =  0;
+
+// Lens calibration, focal length in 0.01 mm every ZoomLutStep steps from the wide end.
+// A step at the wide end changes the magnification less than one at the tele end, so
+// every step interval is stretched by ZoomStepWeight (permille, the change in log focal
+// length of that segment relative to the flattest one). A velocity then zooms at the same
+// perceived rate across the range and never steps faster than it used to.
+const int ZoomLutStep =  100;
+constexpr uint16_t ZoomFocalLut[] = {
+  470,  515,  569,  634,  714,  810,  928,  1072,  1250,  1471,  1746,  2091,  2526,  3079,  3787,  4700
+};
+constexpr int ZoomLutSize = sizeof(ZoomFocalLut) / sizeof(ZoomFocalLut[0]);
+uint16_t ZoomStepWeight[ZoomLutSize -  1]; // filled in from the LUT by setup()
+
+// Timed moves (d<ms> before t/Z) stretch the step interval to land on time
+const long FastestZoomSpeed =  2000 *  0.65;
+unsigned long MoveDuration =  0; // ms, cleared when the move arrives
+
+// Scheduled start (@<ms> before t/Z): the move is loaded right away but held
+// until millis() reaches the given board time, so several boards start together
+const unsigned long MaxScheduleAhead =  60000; // ms, anything further out is a bad clock offset
+bool StartScheduled = false;
+unsigned long ScheduledStart =  0;
+
+// Position telemetry (zpos <zoom> <setpoint>), only sent while something changes
+const unsigned long TelemetryInterval =  20; // ms, one report per host control tick
+char TelemetryFrame[16] = ""; // newest zpos line not sent yet, a newer one replaces it
+bool TelemetryForce = false;
+int LastReportedZoomPos =  0;
+int LastReportedSetpoint =  0;
+
+// Position journal, same scheme as the main board: once the lens has been still for
+// JournalIdle its position goes into the next record of a ring over the whole EEPROM,
+// and the record's valid byte is cleared the moment it moves again. A valid record at
+// boot means the lens stopped cleanly, the position is taken over and homing skipped.
+// Records are written a byte per journal tick: the record being replaced is invalidated
+// first, then the new one's valid cleared, the rest written and valid set last.
+struct PositionRecord {
+  uint8_t magic;
+  uint8_t valid; // not covered by check, it is cleared on its own
+  uint16_t seq;
+  int16_t zoom;
+  uint8_t check;
+};
+const uint8_t JournalMagic =  0xC6;
+const int JournalSlots = (E2END +  1) / sizeof(PositionRecord);
+const unsigned long JournalIdle =  1000; // ms
+const unsigned long JournalTick =  5; // ms, longer than an EEPROM write
+int JournalSlot = -1; // record of the last write, -1 while the EEPROM holds none
+uint16_t JournalSeq =  0;
+bool JournalValid = false;
+PositionRecord JournalRecord; // being written, JournalSlot moves on to its slot at the first step
+int JournalStep = -1; // next byte of JournalRecord, -1 while none is under way
+int JournalZoomPos =  0;
+unsigned long JournalIdleSince =  0;
+
 void setup() {
   // Initialize pins
   pinMode(StepZ, OUTPUT);
@@ -51,60 +246,194 @@ void setup() {
   SafeString::setOutput(Serial);
   sfReader.setTimeout(1000);
   sfReader.flushInput();
-  sfReader.connect(Serial);
+  sfReader.connect(SerialInput);
 
   // Initialize stepper motor
-  StepTimer = millis();
-  zero_zoom_pos();
+  init_zoom_weights();
+  StepTimer = micros();
+  if (!journal_restore()) {
+    HomingSteps = ZoomHomingSteps;
+    ZoomHomed = false;
+  }
+  start_tasks();
 }
 
-bool can_we_step_zoom(int interval) {
-  return ((millis() - StepTimer) >= interval);
+void init_zoom_weights() {
+  float flattest =  0;
+  for (int i =  0; i < ZoomLutSize -  1; i++) {
+    float change = log((float)ZoomFocalLut[i +  1] / ZoomFocalLut[i]);
+    if (i ==  0 || change < flattest) {
+      flattest = change;
+    }
+  }
+  for (int i =  0; i < ZoomLutSize -  1; i++) {
+    ZoomStepWeight[i] = (uint16_t)(1000 * log((float)ZoomFocalLut[i +  1] / ZoomFocalLut[i]) / flattest +  0.5);
+  }
+}
+
+int zoom_segment(int pos) {
+  return constrain(pos / ZoomLutStep,  0, ZoomLutSize -  2);
+}
+
+// Sum of the step weights between two positions, the base interval of a timed move spreads over this
+long zoom_weighted_steps(int from, int to) {
+  if (from > to) {
+    int swap = from;
+    from = to;
+    to = swap;
+  }
+  long total =  0;
+  while (from < to) {
+    int segment = zoom_segment(from);
+    int end = (segment == ZoomLutSize -  2) ? to : min(to, (segment +  1) * ZoomLutStep);
+    total += (long)(end - from) * ZoomStepWeight[segment];
+    from = end;
+  }
+  return total;
+}
+
+// Interval of the next step, iStepperZoomSpeed is the flattest segment's
+long zoom_step_interval() {
+  int from = (iStepperZoomMove == ZOOM_OUT) ? iStepperZoomPos -  1 : iStepperZoomPos;
+  long weight = ZoomStepWeight[zoom_segment(from)];
+  return iStepperZoomSpeed /  1000 * weight + iStepperZoomSpeed %  1000 * weight /  1000;
+}
+
+// Intervals are microseconds, like the pan/tilt step delays
+bool can_we_step_zoom(unsigned long interval) {
+  return ((micros() - StepTimer) >= interval);
 }
 
 void step_zoom_stepper() {
   digitalWrite(StepZ, !digitalRead(StepZ));
-  StepTimer = millis();
+  StepTimer = micros();
+}
+
+// Step interval (us) toward a limit left steps away: the normal interval, or longer
+// so the lens can still stop on the limit. 0 means it is on the limit.
+unsigned long limit_interval(unsigned long interval, long left) {
+  if (left <=  0) {
+    return  0;
+  }
+  if (left >= LimitRampSteps) {
+    return interval;
+  }
+  unsigned long slowest =  1000000.0 / sqrt(2.0 * ZoomLimitDecel * left);
+  return max(interval, slowest);
 }
 
 void handle_zoom_stepper() {
-  if (iStepperZoomMove != ZOOM_STOP && can_we_step_zoom(iStepperZoomSpeed)) {
+  if (HomingSteps >  0) {
+    handle_homing();
+    return;
+  }
+  if (iStepperZoomMove == ZOOM_STOP) {
+    return;
+  }
+  long left = (iStepperZoomMove == ZOOM_IN) ? (long)StoredZoomBStop - iStepperZoomPos : (long)iStepperZoomPos - StoredZoomAStop;
+  unsigned long interval = limit_interval(zoom_step_interval(), left);
+  if (interval !=  0 && can_we_step_zoom(interval)) {
+    digitalWrite(DirZ, (iStepperZoomMove == ZOOM_OUT) ? HIGH : LOW);
     step_zoom_stepper();
     iStepperZoomPos += (iStepperZoomMove == ZOOM_IN) ?  1 : -1;
   }
 }
 
-void zero_zoom_pos() {
+// Zoom out past the wide end, wherever the lens was, and call that 0
+void handle_homing() {
+  if (!can_we_step_zoom(iStepperZoomSpeed)) {
+    return;
+  }
   digitalWrite(DirZ, HIGH); // Zoom out
-  for (int i =  0; i <=  1140; i++) {
-    if (can_we_step_zoom(iStepperZoomSpeed)) {
-      step_zoom_stepper();
-    } else {
-      i--;
-    }
+  step_zoom_stepper();
+  HomingSteps--;
+  if (HomingSteps ==  0) {
+    iStepperZoomPos =  0;
+    ZoomHomed = true;
+  }
+}
+
+// Move events are sent the moment they happen, telemetry only every TelemetryInterval.
+// The board time lets the host line up moves across boards.
+void report_move(const char *event, int setpoint) {
+  Tx.print("mv ");
+  Tx.print(event);
+  Tx.print(" ");
+  Tx.print(setpoint);
+  Tx.print(" ");
+  Tx.println(millis());
+}
+
+void report_credit() {
+  CreditReported = SerialInput.taken_count();
+  Tx.print("cr ");
+  Tx.println(CreditReported + CreditWindow);
+}
+
+void handle_credit() {
+  unsigned int unreported = SerialInput.taken_count() - CreditReported;
+  if (unreported ==  0 || (unreported < CreditBatch && SerialInput.available() >  0)) {
+    return;
+  }
+  report_credit();
+}
+
+void load_setpoint_target() {
+  switch (SetpointStarted) {
+    case SETPOINT_A:
+      TargetZoomPos = StoredZoomPos;
+      break;
+    case SETPOINT_B:
+      TargetZoomPos = StoredZoomPosB;
+      break;
+    case SETPOINT_C:
+      TargetZoomPos = StoredZoomPosC;
+      break;
+    case SETPOINT_D:
+      TargetZoomPos = StoredZoomPosD;
+      break;
+    // SETPOINT_DIRECT keeps the target it was given
+  }
+  TargetZoomPos = constrain(TargetZoomPos, StoredZoomAStop, StoredZoomBStop);
+}
+
+// Eased like any other zoom move, the weighted steps of the path add up to MoveDuration
+void apply_move_duration() {
+  long weighted = zoom_weighted_steps(iStepperZoomPos, TargetZoomPos);
+  if (MoveDuration ==  0 || weighted ==  0) {
+    return;
+  }
+  iStepperZoomSpeed = max((long)((float)MoveDuration *  1000000 / weighted), FastestZoomSpeed);
+  StepTimer = micros();
+}
+
+void start_setpoint(int setpoint) {
+  SetpointStarted = setpoint;
+  JogZoom =  0;
+  load_setpoint_target();
+  if (!StartScheduled) {
+    apply_move_duration();
+    report_move("start", SetpointStarted);
+  } else {
+    iStepperZoomMove = ZOOM_STOP; // the move waits standing still, whatever ran stops here
   }
-  iStepperZoomPos =  0;
 }
 
 void handle_setpoint_motion() {
   if (SetpointStarted >  0) {
+    if (StartScheduled) {
+      if ((long)(millis() - ScheduledStart) <  0) {
+        return;
+      }
+      StartScheduled = false;
+      apply_move_duration();
+      report_move("start", SetpointStarted);
+    }
+
     BlockUserInput =  1;
 
     // Determine target position based on setpoint
-    switch (SetpointStarted) {
-      case SETPOINT_A:
-        TargetZoomPos = StoredZoomPos;
-        break;
-      case SETPOINT_B:
-        TargetZoomPos = StoredZoomPosB;
-        break;
-      case SETPOINT_C:
-        TargetZoomPos = StoredZoomPosC;
-        break;
-      case SETPOINT_D:
-        TargetZoomPos = StoredZoomPosD;
-        break;
-    }
+    load_setpoint_target();
 
     // Determine zoom direction
     iStepperZoomMove = (iStepperZoomPos < TargetZoomPos) ? ZOOM_IN : ZOOM_OUT;
@@ -112,16 +441,253 @@ void handle_setpoint_motion() {
     // Stop moving when target position is reached
     if (iStepperZoomPos == TargetZoomPos) {
       iStepperZoomMove = ZOOM_STOP;
+      report_move("done", SetpointStarted);
       SetpointStarted =  0;
       BlockUserInput =  0;
+      if (MoveDuration >  0) {
+        MoveDuration =  0;
+        iStepperZoomSpeed = JogZoomSpeed;
+      }
     }
   }
 }
 
+void handle_jog(long zoom) {
+  JogZoom = zoom;
+  if (zoom ==  0) {
+    iStepperZoomMove = ZOOM_STOP;
+    iStepperZoomSpeed = JogZoomSpeed;
+    return;
+  }
+
+  iStepperZoomMove = (zoom >  0) ? ZOOM_IN : ZOOM_OUT;
+  long interval = JogZoomSpeed *  1000 / abs(zoom);
+  iStepperZoomSpeed = (interval > JogMaxInterval) ? JogMaxInterval : interval;
+}
+
+// Stop lane: the lens stops on the spot, moves, jogs and anything scheduled are dropped
+void emergency_stop() {
+  int stopped = SetpointStarted;
+  iStepperZoomMove = ZOOM_STOP;
+  JogZoom =  0;
+  TargetZoomPos = iStepperZoomPos;
+  SetpointStarted =  0;
+  StartScheduled = false;
+  MoveDuration =  0;
+  BlockUserInput =  0;
+  HomingSteps =  0; // ZoomHomed stays false, the lens is somewhere in the sweep
+  iStepperZoomSpeed = JogZoomSpeed;
+  sfReader.clear(); // a token cut in half by the stop
+  report_move("stop", stopped);
+  report_credit(); // the count restarted with the stop
+}
+
+void handle_jog_deadman() {
+  if (JogTimeout ==  0 || JogZoom ==  0 || millis() - JogRefreshed < JogTimeout) {
+    return;
+  }
+  if (JogZoom >  0) {
+    handle_jog(max(JogZoom - JogStopStep,  0L));
+  } else {
+    handle_jog(min(JogZoom + JogStopStep,  0L));
+  }
+}
+
+void handle_stepper_control() {
+  handle_zoom_stepper();
+  handle_setpoint_motion();
+}
+
+uint8_t journal_check(const PositionRecord &record) {
+  const uint8_t *bytes = (const uint8_t *)&record;
+  uint8_t check =  0x5A;
+  for (unsigned int i =  0; i < offsetof(PositionRecord, check); i++) {
+    if (i != offsetof(PositionRecord, valid)) {
+      check = ((check <<  1) | (check >>  7)) ^ bytes[i];
+    }
+  }
+  return check;
+}
+
+// Take over the newest record's position if the lens stopped cleanly before the reset
+bool journal_restore() {
+  PositionRecord newest = {};
+  for (int i =  0; i < JournalSlots; i++) {
+    PositionRecord record;
+    EEPROM.get(i * sizeof(PositionRecord), record);
+    if (record.magic != JournalMagic || record.check != journal_check(record)) {
+      continue;
+    }
+    if (JournalSlot <  0 || (int16_t)(record.seq - newest.seq) >  0) {
+      newest = record;
+      JournalSlot = i;
+    }
+  }
+  if (JournalSlot <  0) {
+    return false;
+  }
+  JournalSeq = newest.seq;
+  if (newest.valid !=  1) {
+    return false;
+  }
+  iStepperZoomPos = TargetZoomPos = JournalZoomPos = newest.zoom;
+  JournalValid = true;
+  return true;
+}
+
+void journal_begin() {
+  JournalSeq++;
+  JournalRecord.magic = JournalMagic;
+  JournalRecord.valid =  1;
+  JournalRecord.seq = JournalSeq;
+  JournalRecord.zoom = iStepperZoomPos;
+  JournalRecord.check = journal_check(JournalRecord);
+  JournalZoomPos = iStepperZoomPos;
+  JournalStep =  0;
+}
+
+// Next byte of the record once the EEPROM is free: the last record invalidated and the
+// next slot taken, valid cleared, the rest, valid set
+void journal_step() {
+  if (!eeprom_is_ready()) {
+    return;
+  }
+  const int valid = offsetof(PositionRecord, valid);
+  if (JournalStep ==  0) {
+    // ea moves the zero of a still lens, a reset before the new record is complete
+    // must not bring back the old position
+    if (JournalValid) {
+      EEPROM.update(JournalSlot * sizeof(PositionRecord) + valid,  0);
+      JournalValid = false;
+    }
+    JournalSlot = (JournalSlot +  1) % JournalSlots;
+    JournalStep++;
+    return;
+  }
+  int base = JournalSlot * sizeof(PositionRecord);
+  if (JournalStep ==  1) {
+    EEPROM.update(base + valid,  0);
+  } else if (JournalStep <= (int)sizeof(PositionRecord)) {
+    int i = (JournalStep -  1 <= valid) ? JournalStep -  2 : JournalStep -  1;
+    EEPROM.update(base + i, ((const uint8_t *)&JournalRecord)[i]);
+  } else {
+    EEPROM.update(base + valid,  1);
+    JournalStep = -1;
+    JournalValid = true;
+    return;
+  }
+  JournalStep++;
+}
+
+bool zoom_moving() {
+  return iStepperZoomMove != ZOOM_STOP || SetpointStarted !=  0 || HomingSteps >  0;
+}
+
+// Runs before the stepper on every pass, so the record is invalid before the first step of a move,
+// or within one EEPROM write of it when the journal task was writing
+void journal_guard() {
+  if (!zoom_moving()) {
+    return;
+  }
+  JournalIdleSince = millis();
+  JournalStep = -1; // a record under way is left with its valid byte clear
+  // never wait out a journal write here, the clear is tried again on the next pass
+  if (JournalValid && eeprom_is_ready()) {
+    EEPROM.update(JournalSlot * sizeof(PositionRecord) + offsetof(PositionRecord, valid),  0);
+    JournalValid = false;
+  }
+}
+
+void handle_journal() {
+  if (JournalStep >=  0) {
+    journal_step();
+    return;
+  }
+  if (!ZoomHomed || zoom_moving() || millis() - JournalIdleSince < JournalIdle) {
+    return;
+  }
+  // ea moves the zero without a step, that is a new position too
+  if (!JournalValid || iStepperZoomPos != JournalZoomPos) {
+    journal_begin();
+  }
+}
+
+void handle_telemetry() {
+  if (!TelemetryForce && iStepperZoomPos == LastReportedZoomPos && SetpointStarted == LastReportedSetpoint) {
+    return;
+  }
+  TelemetryForce = false;
+  LastReportedZoomPos = iStepperZoomPos;
+  LastReportedSetpoint = SetpointStarted;
+
+  snprintf(TelemetryFrame, sizeof(TelemetryFrame), "zpos %d %d\r\n", iStepperZoomPos, SetpointStarted);
+}
+
+// Every pass: queued replies first, then the telemetry frame once the core can take all of it
+void handle_tx() {
+  if (!Tx.drain() || TelemetryFrame[0] == '\0') {
+    return;
+  }
+  size_t length = strlen(TelemetryFrame);
+  if (Serial.availableForWrite() < (int)length) {
+    return;
+  }
+  Serial.write((const uint8_t *)TelemetryFrame, length);
+  TelemetryFrame[0] = '\0';
+}
+
 void handle_data_input() {
   if (sfReader.read()) {
     if (sfReader == "info") {
-      Serial.println("zoom_module");
+      Tx.println("zoom_module");
+    }
+    // hello zoom_module <protocol> <build hash> <capabilities>, hash and capabilities in hex
+    else if (sfReader == "hello") {
+      Tx.print("hello zoom_module ");
+      Tx.print(ProtocolVersion);
+      Tx.print(" ");
+      Tx.print((unsigned long)FIRMWARE_HASH, HEX);
+      Tx.print(" ");
+      Tx.println(Capabilities, HEX);
+    }
+    else if (sfReader == "q") {
+      TelemetryForce = true;
+    }
+    else if (sfReader == "o") {
+      report_overruns();
+    }
+    // Clock ping, k<n> is answered with clk <n> <millis> straight away
+    else if (sfReader.startsWith("k")) {
+      Tx.print("clk ");
+      Tx.print(sfReader.c_str() +  1);
+      Tx.print(" ");
+      Tx.println(millis());
+    }
+    // Hold the next move until board time <ms>
+    else if (sfReader.startsWith("@")) {
+      unsigned long at = strtoul(sfReader.c_str() +  1, NULL,  10);
+      if (at - millis() <= MaxScheduleAhead) {
+        ScheduledStart = at;
+        StartScheduled = true;
+      }
+    }
+    // Jog velocity, only the zoom field is ours. A preset or target move runs to the end.
+    else if (sfReader.startsWith("j")) {
+      if (SetpointStarted ==  0) {
+        const char *field = strchr(sfReader.c_str(), ',');
+        field = field ? strchr(field +  1, ',') : NULL;
+        long zoom = field ? strtol(field +  1, NULL,  10) :  0;
+        handle_jog(constrain(zoom, -1000,  1000));
+        JogRefreshed = millis();
+      }
+    }
+    // Jog deadman timeout
+    else if (sfReader.startsWith("w")) {
+      long timeout = strtol(sfReader.c_str() +  1, NULL,  10);
+      if (timeout >=  0) {
+        JogTimeout = timeout;
+        JogRefreshed = millis();
+      }
     }
     // Zoom control
     else if (sfReader == "4") {
@@ -135,7 +701,9 @@ void handle_data_input() {
     }
     // Set/move to target
     else if (sfReader.startsWith("s")) {
-      int setpoint = sfReader.substring(1).toInt();
+      int setpoint =  1; // plain "s" is the first setpoint
+      sfReader.removeBefore(1);
+      sfReader.toInt(setpoint);
       switch (setpoint) {
         case  1:
           StoredZoomPos = iStepperZoomPos;
@@ -152,15 +720,56 @@ void handle_data_input() {
       }
     }
     else if (sfReader.startsWith("t")) {
-      SetpointStarted = sfReader.substring(1).toInt();
+      int setpoint =  1;
+      sfReader.removeBefore(1);
+      sfReader.toInt(setpoint);
+      start_setpoint(setpoint);
+    }
+    // Duration of the next move in ms
+    else if (sfReader.startsWith("d")) {
+      long duration;
+      sfReader.removeBefore(1);
+      if (sfReader.toLong(duration) && duration >=  0) {
+        MoveDuration = duration;
+      }
+    }
+    // Absolute position
+    else if (sfReader.startsWith("Z")) {
+      int target;
+      sfReader.removeBefore(1);
+      if (sfReader.toInt(target)) {
+        TargetZoomPos = constrain(target, StoredZoomAStop, StoredZoomBStop);
+        SetpointStarted = SETPOINT_DIRECT;
+        JogZoom =  0;
+        if (!StartScheduled) {
+          apply_move_duration();
+          report_move("start", SetpointStarted);
+        } else {
+          iStepperZoomMove = ZOOM_STOP;
+        }
+      }
     }
     // Speed control
     else if (sfReader.startsWith("z")) {
-      iStepperZoomSpeed = sfReader.substring(1).toInt();
+      sfReader.removeBefore(1);
+      if (sfReader.toLong(iStepperZoomSpeed)) {
+        JogZoomSpeed = iStepperZoomSpeed;
+      }
+    }
+    // Zoom limits from the host
+    else if (sfReader.startsWith("Lz")) {
+      char *next;
+      long low = strtol(sfReader.c_str() +  2, &next,  10);
+      long high = (*next == ',') ? strtol(next +  1, NULL,  10) : low -  1;
+      if (low <= high) {
+        StoredZoomAStop = constrain(low, -32768,  32767);
+        StoredZoomBStop = constrain(high, -32768,  32767);
+      }
     }
     // Reset zoom position
     else if (sfReader == "ea") {
       iStepperZoomPos =  0;
+      ZoomHomed = true;
       StoredZoomBStop =  1490;
     }
     // Update B stop position
@@ -174,7 +783,87 @@ void handle_data_input() {
   }
 }
 
+// Parser task, a few tokens per tick keeps well ahead of the line rate. Held while homing.
+const int InputBatch =  4;
+void handle_input() {
+  if (HomingSteps >  0) {
+    return;
+  }
+  for (int i =  0; i < InputBatch; i++) {
+    handle_data_input(); // reads at most one token
+  }
+  handle_credit();
+}
+
+// Cooperative scheduler, as on the main board: stepping and the stop lane every pass
+// of loop(), the rest as fixed-rate tasks with a deadline, the most overdue one per pass.
+struct Task {
+  void (*run)();
+  unsigned long period; // us
+  unsigned long deadline; // us
+  unsigned long due;
+  unsigned int overruns;
+};
+Task Tasks[] = {
+  { handle_input,  1000,  1000,  0,  0 },
+  { handle_jog_deadman, JogStopTick *  1000,  2000,  0,  0 },
+  { handle_telemetry, TelemetryInterval *  1000,  5000,  0,  0 },
+  { handle_journal, JournalTick *  1000, JournalTick *  1000,  0,  0 },
+};
+const int TaskCount = sizeof(Tasks) / sizeof(Tasks[0]);
+
+void start_tasks() {
+  unsigned long now = micros();
+  for (int i =  0; i < TaskCount; i++) {
+    Tasks[i].due = now;
+  }
+}
+
+void run_tasks() {
+  unsigned long now = micros();
+  Task *next = NULL;
+  for (int i =  0; i < TaskCount; i++) {
+    if ((long)(now - Tasks[i].due) >=  0 && (next == NULL || (long)(Tasks[i].due - next->due) <  0)) {
+      next = &Tasks[i];
+    }
+  }
+  if (next == NULL) {
+    return;
+  }
+  if (now - next->due > next->deadline) {
+    next->overruns++;
+  }
+  next->due += next->period;
+  if ((long)(now - next->due) >=  0) {
+    next->due = now + next->period;
+  }
+  next->run();
+}
+
+unsigned long WorstPass =  0; // us, longest pass of loop() since the last ovr
+
+void report_overruns() {
+  Tx.print("ovr");
+  for (int i =  0; i < TaskCount; i++) {
+    Tx.print(" ");
+    Tx.print(Tasks[i].overruns);
+  }
+  Tx.print(" ");
+  Tx.println(WorstPass);
+  WorstPass =  0;
+}
+
 void loop() {
-  handle_data_input();
+  unsigned long start = micros();
+  if (SerialInput.poll()) {
+    emergency_stop();
+  }
+  journal_guard();
   handle_stepper_control();
-}
\ No newline at end of file
+  run_tasks();
+  handle_tx();
+  unsigned long pass = micros() - start;
+  if (pass > WorstPass) {
+    WorstPass = pass;
+  }
+}
@@ -1,26 +1,684 @@
 const http = require('http');
+const net = require('net');
 const url = require('url');
-const fs = require('fs');
+const WebSocket = require('ws');
 
-const cmd_file = String(process.env.CAMERA_CMD_FILE) || "";
+const ctrl_host = process.env.CAMERA_CTRL_HOST || '127.0.0.1';
+const ctrl_port = Number(process.env.CAMERA_CTRL_PORT) || 8081;
+
+const ACK_TIMEOUT_MS = 2000; // give up on a command the controller never acked
+const RECONNECT_MS = 1000;
+const MAX_BACKLOG = 64; // commands held while the controller is unreachable
+
+// Binary WebSocket frames on /ws, all little endian
+const WS_VELOCITY = 0x01; // client -> server: u8 type, i16 pitch, i16 yaw, i16 zoom (permille)
+const WS_POSITION = 0x02; // server -> client: u8 type, i32 pitch, i32 yaw, i32 zoom (steps)
+const WS_TARGET = 0x03; // client -> server: u8 type, u8 axis mask (1 pitch, 2 yaw, 4 zoom), i32 pitch, i32 yaw, i32 zoom (steps)
+const WS_STOP = 0x04; // client -> server: u8 type, stop every axis now
+const JOG_MAX = 1000;
+
+const DEFAULT_RIG = '1'; // until the controller has listed its rigs
+const SSE_KEEPALIVE_MS = 15000;
+const ARRIVAL_TIMEOUT_MS = 20000; // longest a ?wait=arrived request is held open
 
 console.log('Starting up...');
-console.log('  CAMERA_CMD_FILE=%s', cmd_file);
+console.log('  CAMERA_CTRL_HOST=%s', ctrl_host);
+console.log('  CAMERA_CTRL_PORT=%d', ctrl_port);
+
+// Persistent link to CameraController.py. Commands are written as JSON lines
+// in arrival order and every one is answered with an ack carrying its seq.
+let ctrl = null;
+let ctrl_connected = false;
+let ctrl_rx = '';
+let next_seq = 1;
+const pending = new Map(); // seq -> { label, resolve, timer, sent }
+const backlog = []; // lines waiting for the link to come up
+
+// Per rig state fed by the single controller subscription, served as a
+// snapshot on /status and streamed to any number of /events clients.
+// Every endpoint takes ?rig=<id>, without it the controller's first rig is used.
+const status = {
+  controller: false,
+  rigs: {}, // id -> { online, position, move }
+};
+let rig_ids = []; // in controller order
+const sse_clients = new Map(); // res -> rig id to filter on, or null for all
+const arrival_waiters = new Set(); // { rig, slot, id, resolve, timer }
+const sync_waiters = new Map(); // sync id -> { resolve, timer }
+
+function rig_state(rig) {
+  if (typeof status.rigs[rig] === 'undefined') {
+    status.rigs[rig] = {
+      online: false,
+      boards: {}, // main/zoom -> { module, protocol, build, caps } from the board's hello
+      position: { pitch: 0, yaw: 0, zoom: 0 },
+      move: { id: 0, slot: 0, moving: false, started_at: null, arrived_at: null },
+    };
+  }
+  return status.rigs[rig];
+}
 
-http
-  .createServer(function (req, res) {
-    const q = url.parse(req.url, true).query;
-    if (typeof q.cmd !== 'undefined') {
-      console.log(q.cmd);
+// the rig a request is for, or null if the controller has no such rig
+function resolve_rig(q) {
+  if (typeof q.rig === 'undefined') {
+    return rig_ids.length > 0 ? rig_ids[0] : DEFAULT_RIG;
+  }
+  const rig = String([].concat(q.rig)[0]);
+  return rig_ids.length === 0 || rig_ids.includes(rig) ? rig : null;
+}
+
+function connect_controller() {
+  ctrl = net.createConnection({ host: ctrl_host, port: ctrl_port });
+  ctrl.setNoDelay(true);
+  ctrl.setKeepAlive(true, 1000);
+
+  ctrl.on('connect', function () {
+    console.log('Connected to controller');
+    ctrl_connected = true;
+    status.controller = true;
+    publish('status', status);
+    while (backlog.length > 0) {
+      ctrl.write(backlog.shift().line);
+    }
+  });
+
+  ctrl.on('data', function (chunk) {
+    ctrl_rx += chunk.toString('utf8');
+    let nl;
+    while ((nl = ctrl_rx.indexOf('\n')) >= 0) {
+      const line = ctrl_rx.slice(0, nl).trim();
+      ctrl_rx = ctrl_rx.slice(nl + 1);
+      if (line === '') {
+        continue;
+      }
       try {
-        fs.writeFileSync(cmd_file, q.cmd);
-        // file written successfully
+        handle_controller_msg(JSON.parse(line));
       } catch (err) {
-        console.error(err);
+        console.error('Bad controller message: %s', line);
+      }
+    }
+  });
+
+  ctrl.on('error', function (err) {
+    if (ctrl_connected) {
+      console.error(err.message);
+    }
+  });
+
+  ctrl.on('close', function () {
+    if (ctrl_connected) {
+      console.log('Lost controller connection');
+    }
+    ctrl_connected = false;
+    ctrl_rx = '';
+    if (status.controller) {
+      status.controller = false;
+      publish('status', status);
+    }
+    // anything already written is in an unknown state, report it as such
+    for (const [seq, p] of pending) {
+      if (!backlog.some((b) => b.seq === seq)) {
+        settle(seq, { ok: false, status: 'disconnected', error: 'controller connection lost' });
+      }
+    }
+    setTimeout(connect_controller, RECONNECT_MS);
+  });
+}
+
+function handle_controller_msg(msg) {
+  if (typeof msg.rigs !== 'undefined') {
+    rig_ids = msg.rigs.map(String);
+    Object.keys(status.rigs).forEach(function (rig) {
+      if (!rig_ids.includes(rig)) {
+        delete status.rigs[rig];
+      }
+    });
+    rig_ids.forEach(rig_state);
+    publish('status', status);
+  }
+  if (typeof msg.online !== 'undefined') {
+    rig_state(msg.rig).online = msg.online;
+    publish('status', status);
+  }
+  if (typeof msg.boards !== 'undefined') {
+    rig_state(msg.rig).boards = msg.boards;
+    publish('status', status);
+  }
+  if (typeof msg.tel !== 'undefined') {
+    const st = rig_state(msg.rig);
+    st.position = { pitch: msg.tel.pitch, yaw: msg.tel.yaw, zoom: msg.tel.zoom };
+    publish('position', Object.assign({ rig: msg.rig }, st.position), msg.rig);
+    broadcast_position(msg.rig, msg.tel);
+  }
+  if (typeof msg.evt !== 'undefined') {
+    if (msg.evt.type === 'sync') {
+      handle_sync_report(msg.evt);
+    } else {
+      handle_controller_event(msg.rig, msg.evt);
+    }
+  }
+  if (typeof msg.ack !== 'undefined') {
+    const result = msg.ok ? { ok: true, status: 'acked' } : { ok: false, status: 'rejected', error: msg.error };
+    if (typeof msg.sync !== 'undefined') {
+      result.sync = msg.sync;
+    }
+    settle(msg.ack, result);
+  }
+}
+
+function handle_controller_event(rig, evt) {
+  const now = new Date().toISOString();
+  const st = rig_state(rig);
+  if (evt.type === 'move') {
+    st.move = { id: evt.id, slot: evt.slot, moving: true, started_at: now, arrived_at: null };
+    publish('move', Object.assign({ rig: rig }, st.move), rig);
+  } else if (evt.type === 'arrived') {
+    st.move = Object.assign({}, st.move, { id: evt.id, slot: evt.slot, moving: false, arrived_at: now });
+    publish('arrived', Object.assign({ rig: rig }, st.move), rig);
+  } else if (evt.type === 'stopped') {
+    st.move = Object.assign({}, st.move, { id: evt.id, slot: evt.slot, moving: false });
+    publish('stopped', Object.assign({ rig: rig }, st.move), rig);
+  } else {
+    publish(evt.type, Object.assign({ rig: rig }, evt), rig);
+  }
+  update_arrival_waiters(rig, evt);
+}
+
+// A waiter latches onto the first move to its slot that starts after it was
+// registered (or the one already under way) and resolves when that move
+// arrives, or is superseded by a move somewhere else on the same rig.
+function wait_for_arrival(rig, slot) {
+  const w = { rig: rig, slot: slot, id: null, resolve: null, timer: null };
+  const move = rig_state(rig).move;
+  w.promise = new Promise(function (resolve) {
+    w.resolve = resolve;
+  });
+  if (move.moving && move.slot === slot) {
+    w.id = move.id;
+  }
+  w.timer = setTimeout(function () {
+    finish_arrival_waiter(w, { arrived: false, error: 'no arrival' });
+  }, ARRIVAL_TIMEOUT_MS);
+  arrival_waiters.add(w);
+  return w;
+}
+
+function finish_arrival_waiter(w, result) {
+  clearTimeout(w.timer);
+  arrival_waiters.delete(w);
+  w.resolve(Object.assign(result, { move: rig_state(w.rig).move }));
+}
+
+function update_arrival_waiters(rig, evt) {
+  arrival_waiters.forEach(function (w) {
+    if (w.rig !== rig) {
+      return;
+    } else if (evt.type === 'move') {
+      if (w.id === null && evt.slot === w.slot) {
+        w.id = evt.id;
+      } else if (w.id !== null && evt.id !== w.id) {
+        finish_arrival_waiter(w, { arrived: false, error: 'superseded' });
+      }
+    } else if (evt.type === 'arrived' && evt.id === w.id) {
+      finish_arrival_waiter(w, { arrived: true });
+    } else if (evt.type === 'stopped' && evt.id === w.id) {
+      finish_arrival_waiter(w, { arrived: false, error: 'stopped' });
+    }
+  });
+}
+
+// Coordinated moves report how far apart the boards started and landed once
+// every board is done, see start_sync in CameraController.py
+function handle_sync_report(evt) {
+  publish('sync', evt);
+  const w = sync_waiters.get(evt.id);
+  if (w) {
+    clearTimeout(w.timer);
+    sync_waiters.delete(evt.id);
+    w.resolve({ arrived: evt.complete, report: evt });
+  }
+}
+
+function wait_for_sync(id) {
+  return new Promise(function (resolve) {
+    const timer = setTimeout(function () {
+      sync_waiters.delete(id);
+      resolve({ arrived: false, error: 'no arrival' });
+    }, ARRIVAL_TIMEOUT_MS);
+    sync_waiters.set(id, { resolve: resolve, timer: timer });
+  });
+}
+
+// t, t2.. t4 recall a preset, anything else has no arrival to wait for
+function preset_slot(cmd) {
+  const m = /^t([0-9]*)$/.exec(cmd);
+  return m ? Number(m[1] || 1) : 0;
+}
+
+// rig is left out for events that concern every rig
+function publish(event, data, rig) {
+  const chunk = 'event: ' + event + '\ndata: ' + JSON.stringify(data) + '\n\n';
+  sse_clients.forEach(function (filter, res) {
+    if (filter === null || typeof rig === 'undefined' || filter === rig) {
+      res.write(chunk);
+    }
+  });
+}
+
+function handle_events(req, res, q) {
+  res.writeHead(200, {
+    'Content-Type': 'text/event-stream',
+    'Cache-Control': 'no-cache',
+    Connection: 'keep-alive',
+  });
+  res.write('retry: ' + RECONNECT_MS + '\n');
+  res.write('event: status\ndata: ' + JSON.stringify(status) + '\n\n');
+  sse_clients.set(res, typeof q.rig === 'undefined' ? null : String([].concat(q.rig)[0]));
+  req.on('close', function () {
+    sse_clients.delete(res);
+  });
+}
+
+setInterval(function () {
+  sse_clients.forEach(function (filter, res) {
+    res.write(': keepalive\n\n');
+  });
+}, SSE_KEEPALIVE_MS);
+
+function settle(seq, result) {
+  const p = pending.get(seq);
+  if (!p) {
+    return;
+  }
+  pending.delete(seq);
+  clearTimeout(p.timer);
+  result.ack_ms = Date.now() - p.sent;
+  Object.assign(result, p.label);
+  p.resolve(result);
+}
+
+// Send one message to the controller and resolve with its ack. Messages that
+// must not be replayed late (velocity) set hold to false and fail immediately
+// while the link is down instead of waiting in the backlog.
+function forward_msg(msg, label, hold) {
+  return new Promise(function (resolve) {
+    const seq = next_seq++;
+    const line = JSON.stringify(Object.assign({ seq: seq }, msg)) + '\n';
+
+    if (!ctrl_connected && (!hold || backlog.length >= MAX_BACKLOG)) {
+      resolve(Object.assign({ ok: false, status: 'unavailable', error: 'controller unreachable' }, label));
+      return;
+    }
+
+    const timer = setTimeout(function () {
+      // never let a stale command go out late once the caller gave up on it
+      const i = backlog.findIndex((b) => b.seq === seq);
+      if (i >= 0) {
+        backlog.splice(i, 1);
+        settle(seq, { ok: false, status: 'unavailable', error: 'controller unreachable' });
+      } else {
+        settle(seq, { ok: false, status: 'timeout', error: 'no ack from controller' });
+      }
+    }, ACK_TIMEOUT_MS);
+    pending.set(seq, { label: label, resolve: resolve, timer: timer, sent: Date.now() });
+
+    if (ctrl_connected) {
+      ctrl.write(line);
+    } else {
+      backlog.push({ seq: seq, line: line });
+    }
+  });
+}
+
+function forward_cmd(rig, cmd) {
+  return forward_msg({ rig: rig, cmd: cmd }, { rig: rig, cmd: cmd }, true);
+}
+
+// Latest-value-wins streams: at most one message per stream is in flight to
+// the controller, anything received meanwhile overwrites the one waiting to go.
+// Each rig has its own pair so one busy head never holds up another.
+const rig_streams = {}; // id -> { vel, target }
+
+function streams(rig) {
+  if (typeof rig_streams[rig] === 'undefined') {
+    rig_streams[rig] = {
+      vel: { kind: 'vel', rig: rig, latest: null, in_flight: false },
+      target: { kind: 'target', rig: rig, latest: null, in_flight: false },
+    };
+  }
+  return rig_streams[rig];
+}
+
+function push_velocity(rig, vel) {
+  const stream = streams(rig).vel;
+  stream.latest = vel;
+  pump_stream(stream);
+}
+
+// absolute targets only name the axes that changed, keep the others that are still waiting
+function push_target(rig, target) {
+  const stream = streams(rig).target;
+  stream.latest = Object.assign({}, stream.latest, target);
+  pump_stream(stream);
+}
+
+function pump_stream(stream) {
+  if (stream.in_flight || stream.latest === null) {
+    return;
+  }
+  const msg = { rig: stream.rig };
+  msg[stream.kind] = stream.latest;
+  stream.latest = null;
+  stream.in_flight = true;
+  forward_msg(msg, msg, false).then(function (result) {
+    stream.in_flight = false;
+    if (!result.ok && result.status !== 'unavailable') {
+      console.error('%s for rig %s not applied: %s', stream.kind, stream.rig, result.error);
+    }
+    pump_stream(stream);
+  });
+}
+
+// Stop skips everything queued here: velocity and target waiting to go are dropped
+// and the stop does not wait behind the one in flight
+function send_stop(rig) {
+  const s = streams(rig);
+  s.vel.latest = null;
+  s.target.latest = null;
+  return forward_msg({ rig: rig, stop: true }, { rig: rig, stop: true }, false);
+}
+
+function clamp_jog(v) {
+  return Math.max(-JOG_MAX, Math.min(JOG_MAX, v));
+}
+
+function handle_ws_frame(ws, data, is_binary) {
+  if (!is_binary) {
+    return;
+  }
+  if (data.length >= 1 && data[0] === WS_STOP) {
+    ws.moving = false;
+    send_stop(ws.rig);
+    return;
+  }
+  if (data.length >= 14 && data[0] === WS_TARGET) {
+    const mask = data[1];
+    const target = {};
+    if (mask & 1) {
+      target.pitch = data.readInt32LE(2);
+    }
+    if (mask & 2) {
+      target.yaw = data.readInt32LE(6);
+    }
+    if (mask & 4) {
+      target.zoom = data.readInt32LE(10);
+    }
+    if (mask & 7) {
+      push_target(ws.rig, target);
+    }
+    return;
+  }
+  if (data.length < 7 || data[0] !== WS_VELOCITY) {
+    return;
+  }
+  const vel = {
+    pitch: clamp_jog(data.readInt16LE(1)),
+    yaw: clamp_jog(data.readInt16LE(3)),
+    zoom: clamp_jog(data.readInt16LE(5)),
+  };
+  ws.moving = vel.pitch !== 0 || vel.yaw !== 0 || vel.zoom !== 0;
+  push_velocity(ws.rig, vel);
+}
+
+function broadcast_position(rig, tel) {
+  if (wss.clients.size === 0) {
+    return;
+  }
+  const frame = Buffer.alloc(13);
+  frame.writeUInt8(WS_POSITION, 0);
+  frame.writeInt32LE(tel.pitch, 1);
+  frame.writeInt32LE(tel.yaw, 5);
+  frame.writeInt32LE(tel.zoom, 9);
+  wss.clients.forEach(function (ws) {
+    if (ws.rig === rig && ws.readyState === WebSocket.OPEN) {
+      ws.send(frame);
+    }
+  });
+}
+
+function http_status(results) {
+  if (results.every((r) => r.ok)) {
+    return 200;
+  }
+  const failed = results.find((r) => !r.ok);
+  if (failed.status === 'rejected') {
+    return 502;
+  } else if (failed.status === 'timeout') {
+    return 504;
+  }
+  return 503;
+}
+
+function reply(res, code, body) {
+  res.writeHead(code, { 'Content-Type': 'application/json' });
+  res.end(JSON.stringify(body));
+}
+
+function read_body(req, cb) {
+  let body = '';
+  req.on('data', function (chunk) {
+    body += chunk;
+  });
+  req.on('end', function () {
+    cb(body);
+  });
+}
+
+// Accepts ?cmd=a&cmd=b, or a POST body that is either a JSON array of
+// commands or whitespace separated tokens like the serial protocol itself.
+function parse_batch(q, body) {
+  let cmds = [];
+  if (typeof q.cmd !== 'undefined') {
+    cmds = cmds.concat(q.cmd);
+  }
+  body = body.trim();
+  if (body.startsWith('[')) {
+    cmds = cmds.concat(JSON.parse(body));
+  } else if (body !== '') {
+    cmds = cmds.concat(body.split(/\s+/));
+  }
+  return cmds.map(String);
+}
+
+function handle_batch(req, res, q, rig) {
+  read_body(req, function (body) {
+    let cmds;
+    try {
+      cmds = parse_batch(q, body);
+    } catch (err) {
+      reply(res, 400, { ok: false, error: 'bad batch body' });
+      return;
+    }
+    if (cmds.length === 0) {
+      reply(res, 400, { ok: false, error: 'no commands' });
+      return;
+    }
+    console.log('batch rig %s: %s', rig, cmds.join(' '));
+    // all commands are queued before any ack comes back so they go out pipelined
+    Promise.all(cmds.map((cmd) => forward_cmd(rig, cmd))).then(function (results) {
+      reply(res, http_status(results), { ok: results.every((r) => r.ok), results: results });
+    });
+  });
+}
+
+// Same commands on every ?rig=, or a POST body of {"<rig>": [cmds], ...} for
+// different moves per rig, all starting together ?lead= ms from now.
+function handle_sync(req, res, q) {
+  read_body(req, function (body) {
+    let rigs = {};
+    try {
+      if (body.trim() !== '') {
+        rigs = JSON.parse(body);
+      } else if (typeof q.rig !== 'undefined' && typeof q.cmd !== 'undefined') {
+        [].concat(q.rig).forEach(function (rig) {
+          rigs[String(rig)] = [].concat(q.cmd).map(String);
+        });
+      }
+    } catch (err) {
+      reply(res, 400, { ok: false, error: 'bad sync body' });
+      return;
+    }
+    if (rigs === null || typeof rigs !== 'object' || Object.keys(rigs).length === 0) {
+      reply(res, 400, { ok: false, error: 'no rigs' });
+      return;
+    }
+    const msg = { sync: rigs };
+    if (typeof q.lead !== 'undefined') {
+      msg.lead = Number(q.lead);
+    }
+    console.log('sync %s', JSON.stringify(rigs));
+    forward_msg(msg, { rigs: rigs }, true).then(function (result) {
+      if (!result.ok || q.wait !== 'arrived') {
+        reply(res, http_status([result]), result);
+        return;
+      }
+      wait_for_sync(result.sync).then(function (a) {
+        reply(res, a.arrived ? 200 : 504, Object.assign(result, a));
+      });
+    });
+  });
+}
+
+// /record?name=take1 starts recording the rig's moves, /record?stop=1 ends it
+function handle_record(res, q, rig) {
+  const name = q.stop === '1' ? false : String([].concat(q.name)[0]);
+  if (name !== false && typeof q.name === 'undefined') {
+    reply(res, 400, { ok: false, error: 'missing name' });
+    return;
+  }
+  forward_msg({ rig: rig, record: name }, { rig: rig, record: name }, false).then(function (result) {
+    reply(res, http_status([result]), result);
+  });
+}
+
+// /replay?name=take1&scale=2&from=1000&to=5000 plays a recording back (scale 2 is
+// half speed, from/to in ms of the recording), /replay?stop=1 ends it early.
+// The end of a replay is published as a replay_done event.
+function handle_replay(res, q, rig) {
+  let replay = false;
+  if (q.stop !== '1') {
+    if (typeof q.name === 'undefined') {
+      reply(res, 400, { ok: false, error: 'missing name' });
+      return;
+    }
+    replay = { name: String([].concat(q.name)[0]) };
+    if (typeof q.scale !== 'undefined') {
+      replay.scale = Number(q.scale);
+    }
+    if (typeof q.from !== 'undefined') {
+      replay.from_ms = Number(q.from);
+    }
+    if (typeof q.to !== 'undefined') {
+      replay.to_ms = Number(q.to);
+    }
+  }
+  forward_msg({ rig: rig, replay: replay }, { rig: rig, replay: replay }, false).then(function (result) {
+    reply(res, http_status([result]), result);
+  });
+}
+
+const server = http.createServer(function (req, res) {
+  const u = url.parse(req.url, true);
+  const q = u.query;
+
+  if (u.pathname === '/status' && typeof q.rig === 'undefined') {
+    reply(res, 200, status);
+    return;
+  } else if (u.pathname === '/events') {
+    handle_events(req, res, q);
+    return;
+  } else if (u.pathname === '/sync') {
+    handle_sync(req, res, q);
+    return;
+  }
+
+  const rig = resolve_rig(q);
+  if (rig === null) {
+    reply(res, 404, { ok: false, error: 'unknown rig' });
+    return;
+  }
+
+  if (u.pathname === '/batch') {
+    handle_batch(req, res, q, rig);
+    return;
+  } else if (u.pathname === '/record') {
+    handle_record(res, q, rig);
+    return;
+  } else if (u.pathname === '/replay') {
+    handle_replay(res, q, rig);
+    return;
+  } else if (u.pathname === '/stop') {
+    console.log('rig %s: stop', rig);
+    send_stop(rig).then(function (result) {
+      reply(res, http_status([result]), result);
+    });
+    return;
+  } else if (u.pathname === '/status') {
+    reply(res, 200, Object.assign({ controller: status.controller, rig: rig }, rig_state(rig)));
+    return;
+  }
+
+  if (typeof q.cmd === 'undefined') {
+    reply(res, 400, { ok: false, error: 'missing cmd' });
+    return;
+  }
+
+  const cmd = String([].concat(q.cmd)[0]);
+  console.log('rig %s: %s', rig, cmd);
+  const slot = preset_slot(cmd);
+  if (q.wait === 'arrived' && slot > 0) {
+    // register before forwarding so a move that is already there is not missed
+    const arrival = wait_for_arrival(rig, slot);
+    forward_cmd(rig, cmd).then(function (result) {
+      if (!result.ok) {
+        finish_arrival_waiter(arrival, { arrived: false });
+        reply(res, http_status([result]), result);
+        return;
       }
+      arrival.promise.then(function (a) {
+        reply(res, a.arrived ? 200 : 504, Object.assign(result, a));
+      });
+    });
+    return;
+  }
+
+  forward_cmd(rig, cmd).then(function (result) {
+    reply(res, http_status([result]), result);
+  });
+});
+
+const wss = new WebSocket.Server({ server: server, path: '/ws' });
+
+wss.on('connection', function (ws, req) {
+  ws.rig = resolve_rig(url.parse(req.url, true).query);
+  if (ws.rig === null) {
+    ws.close(1008, 'unknown rig');
+    return;
+  }
+  console.log('Joystick for rig %s connected from %s', ws.rig, req.socket.remoteAddress);
+  ws.moving = false;
+  ws.on('message', function (data, is_binary) {
+    handle_ws_frame(ws, data, is_binary);
+  });
+  ws.on('close', function () {
+    console.log('Joystick disconnected');
+    // never leave the head running on a dropped tablet
+    if (ws.moving) {
+      push_velocity(ws.rig, { pitch: 0, yaw: 0, zoom: 0 });
     }
+  });
+});
+
+server.listen(8080);
 
-    res.writeHead(200, { 'Content-Type': 'text/html' });
-    res.end('s');
-  })
-  .listen(8080);
+connect_controller();
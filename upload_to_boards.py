@@ -1,76 +1,185 @@
 import time
+import sys
+import os
+import json
+import hashlib
 import serial
 import subprocess
-import re
+from concurrent.futures import ThreadPoolExecutor
 
 ARDUINO_CLI = "/home/jonbons/CameraMotionRig/arduino-cli"
 ARDUINO_BAUDRATE = 115200
+ARDUINO_FQBN = "arduino:avr:uno"
+ARDUINO_BOOT_TIMEOUT = 5  # s, opening the port resets the board and the bootloader runs first
+ARDUINO_INFO_RETRY = 0.25  # s between info requests while the board boots
+
+MODULE_SKETCHES = {"main_module": "camera_async", "zoom_module": "camera_zoom_async"}
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+# one build directory per sketch, reused between runs so unchanged code is never recompiled
+BUILD_DIR = os.path.join(ROOT, "build")
+# USB serial number -> {"module", "hash"} of the last firmware uploaded to that board
+DEPLOY_STATE_FILE = os.path.join(ROOT, ".deploy_state.json")
+
+FORCE = "--force" in sys.argv  # upload to every board even when its firmware is current
+
+os.chdir(ROOT)
 
 # checkout latest from github
 subprocess.check_output(["git", "reset", "--hard"])
 subprocess.check_output(["git", "pull"])
 subprocess.check_output(["git", "checkout", "main"])
 
-regex = r"^(\/dev\/tty.*?) .* (arduino:avr:uno)"
-
-cmd_ret = subprocess.check_output([ARDUINO_CLI, "board", "list", "--timeout", "5s"])
-cmd_ret = cmd_ret.decode("utf-8").split("\n")
-serial_ports = []
-
-for line in cmd_ret:
-    matches = re.finditer(regex, line, re.MULTILINE)
-    for matchNum, match in enumerate(matches, start=1):
-        groups = match.groups()
-        if len(groups) == 2:
-            print("Detected arduino board connected to %s" % (groups[0]))
-            serial_ports.append(groups[0])
-
-arduino_modules = []
-for port in serial_ports:
-    arduino = serial.Serial(port, ARDUINO_BAUDRATE)
-    time.sleep(1)
-    arduino.write(bytes("info", "ascii") + b" ")
-    ser_read = arduino.readline().decode("utf-8").split("\r\n")
-    arduino = None
-    time.sleep(1)
-    arduino_modules.append((port, ser_read[0]))
-    print("Arduino board on %s is the %s" % (port, ser_read[0]))
-
-for arduino in arduino_modules:
-    port = arduino[0]
-    module = arduino[1]
-
-    code_module = ""
-    if module == "main_module":
-        code_module = "camera_async"
-    elif module == "zoom_module":
-        code_module = "camera_zoom_async"
-
-    print("Uploading %s to %s..." % (code_module, port))
-
-    compile_builder = [
-        ARDUINO_CLI,
-        "compile",
-        code_module,
-        "--fqbn",
-        "arduino:avr:uno",
-        "-p",
-        port,
-    ]
-
-    compile_cmd = subprocess.check_output(compile_builder)
-    print(compile_cmd.decode("utf-8"))
-
-    upload_builder = [
-        ARDUINO_CLI,
-        "upload",
-        code_module,
-        "--fqbn",
-        "arduino:avr:uno",
-        "-p",
-        port,
-    ]
-    upload_cmd = subprocess.check_output(upload_builder)
-    print(upload_cmd.decode("utf-8"))
-
-print("Done")
+
+def sketch_hash(sketch):
+    """Hash of a sketch's sources, the firmware only changes when this does.
+    32 bits so it is compiled in as FIRMWARE_HASH and reported back in the board's hello."""
+    h = hashlib.sha256()
+    directory = os.path.join(ROOT, sketch)
+    for name in sorted(os.listdir(directory)):
+        if name.endswith((".ino", ".h", ".cpp", ".c")):
+            h.update(name.encode() + b"\0")
+            with open(os.path.join(directory, name), "rb") as f:
+                h.update(f.read())
+    return h.hexdigest()[:8]
+
+
+def detect_boards():
+    """[(port, usb serial number)] of every Uno, the serial number stays with the board across ports"""
+    out = subprocess.check_output([ARDUINO_CLI, "board", "list", "--format", "json", "--timeout", "5s"])
+    listing = json.loads(out.decode("utf-8"))
+    if isinstance(listing, dict):
+        listing = listing.get("detected_ports", [])
+    boards = []
+    for entry in listing:
+        matching = entry.get("matching_boards") or entry.get("boards") or []
+        if not any(b.get("fqbn") == ARDUINO_FQBN for b in matching):
+            continue
+        port = entry.get("port", entry)
+        props = port.get("properties", {})
+        serial_number = props.get("serialNumber") or port.get("hardware_id") or port["address"]
+        print("Detected arduino board %s connected to %s" % (serial_number, port["address"]))
+        boards.append((port["address"], serial_number))
+    return boards
+
+
+def probe(port):
+    """(module, build hash) of the board as soon as it has booted. Firmware from
+    before the hello frame only answers info, its build hash is None."""
+    with serial.Serial(port, ARDUINO_BAUDRATE, timeout=ARDUINO_INFO_RETRY) as arduino:
+        deadline = time.monotonic() + ARDUINO_BOOT_TIMEOUT
+        while time.monotonic() < deadline:
+            # hello is answered first if the board knows it, info always
+            arduino.write(b"hello info ")
+            build = None
+            line = arduino.readline().decode("utf-8", "replace").strip()
+            while line:
+                fields = line.split()
+                if len(fields) == 5 and fields[0] == "hello":
+                    build = "%08x" % int(fields[3], 16)
+                elif line in MODULE_SKETCHES:
+                    return line, build
+                line = arduino.readline().decode("utf-8", "replace").strip()
+    return None, None
+
+
+def run(cmd):
+    result = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if result.returncode != 0:
+        print(result.stdout.decode("utf-8"))
+        raise subprocess.CalledProcessError(result.returncode, cmd)
+
+
+def compile_sketch(sketch):
+    print("Compiling %s..." % sketch)
+    run(
+        [
+            ARDUINO_CLI,
+            "compile",
+            sketch,
+            "--fqbn",
+            ARDUINO_FQBN,
+            "--build-path",
+            os.path.join(BUILD_DIR, sketch),
+            "--build-property",
+            "compiler.cpp.extra_flags=-DFIRMWARE_HASH=0x%s" % hashes[sketch],
+        ]
+    )
+
+
+def upload(port, sketch):
+    print("Uploading %s to %s..." % (sketch, port))
+    run(
+        [
+            ARDUINO_CLI,
+            "upload",
+            sketch,
+            "--fqbn",
+            ARDUINO_FQBN,
+            "-p",
+            port,
+            "--input-dir",
+            os.path.join(BUILD_DIR, sketch),
+        ]
+    )
+
+
+def load_deploy_state():
+    try:
+        with open(DEPLOY_STATE_FILE) as f:
+            return json.load(f)
+    except (OSError, ValueError):
+        return {}
+
+
+def save_deploy_state(state):
+    with open(DEPLOY_STATE_FILE, "w") as f:
+        json.dump(state, f, indent=2)
+
+
+started = time.monotonic()
+boards = detect_boards()
+hashes = {sketch: sketch_hash(sketch) for sketch in MODULE_SKETCHES.values()}
+state = load_deploy_state()
+
+# every board boots in parallel, the reset wait is paid once
+with ThreadPoolExecutor(max_workers=max(1, len(boards))) as pool:
+    probes = list(pool.map(lambda board: probe(board[0]), boards))
+
+uploads = []
+for (port, serial_number), (module, build) in zip(boards, probes):
+    if module is None:
+        print("Arduino board on %s did not identify itself, skipping" % port)
+        continue
+    sketch = MODULE_SKETCHES[module]
+    print("Arduino board on %s is the %s" % (port, module))
+    # the board's own build hash is the truth, the deploy record covers firmware without hello
+    if build is None:
+        deployed = state.get(serial_number, {})
+        build = deployed.get("hash") if deployed.get("module") == module else None
+    if not FORCE and build == hashes[sketch]:
+        print("%s on %s is up to date (%s)" % (sketch, port, hashes[sketch]))
+        continue
+    uploads.append((port, serial_number, module, sketch))
+
+failed = False
+if uploads:
+    sketches = sorted(set(u[3] for u in uploads))
+    # each sketch is compiled once, however many boards run it
+    with ThreadPoolExecutor(max_workers=len(sketches)) as pool:
+        list(pool.map(compile_sketch, sketches))
+    with ThreadPoolExecutor(max_workers=len(uploads)) as pool:
+        jobs = [(u, pool.submit(upload, u[0], u[3])) for u in uploads]
+        for (port, serial_number, module, sketch), job in jobs:
+            try:
+                job.result()
+            except subprocess.CalledProcessError:
+                failed = True
+                print("Upload of %s to %s failed" % (sketch, port))
+                state.pop(serial_number, None)
+                continue
+            state[serial_number] = {"module": module, "hash": hashes[sketch]}
+    save_deploy_state(state)
+
+print("Done in %.1fs" % (time.monotonic() - started))
+sys.exit(1 if failed else 0)